@@ -1,10 +1,274 @@
 #include "config.h"
 #include "indi_lumix.h"
+#include "lumix_image.h"
 #include "indidevapi.h"
 
+#include <sys/stat.h>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <set>
+
+// Lets LibRaw read a raw file while it is still being downloaded: reads of bytes that haven't
+// arrived yet wait for them. If the download fails the file ends where it stopped.
+// The buffer and its size are fetched through waitFor every time, the download owns them.
+class DownloadDatastream : public LibRaw_buffer_datastream
+{
+public:
+    explicit DownloadDatastream(const std::function<DownloadView(size_t)> &waitFor)
+        : LibRaw_buffer_datastream(nullptr, 0), waitFor(waitFor)
+    {
+        // LibRaw asks for the size of the file first, so that has to be known
+        update(waitFor(0));
+    }
+
+    int read(void *ptr, size_t sz, size_t nmemb) override
+    {
+        require(streampos + sz * nmemb);
+        return LibRaw_buffer_datastream::read(ptr, sz, nmemb);
+    }
+
+    int get_char() override
+    {
+        require(streampos + 1);
+        return LibRaw_buffer_datastream::get_char();
+    }
+
+    char *gets(char *s, int sz) override
+    {
+        require(streampos + sz);
+        return LibRaw_buffer_datastream::gets(s, sz);
+    }
+
+    int scanf_one(const char *fmt, void *val) override
+    {
+        require(streampos + 64);
+        return LibRaw_buffer_datastream::scanf_one(fmt, val);
+    }
+
+    int seek(INT64 o, int whence) override
+    {
+        update(waitFor(0));
+        return LibRaw_buffer_datastream::seek(o, whence);
+    }
+
+    int jpeg_src(void *jpegdata) override
+    {
+        // the JPEG decoder reads the buffer directly
+        require(streamsize);
+        return LibRaw_buffer_datastream::jpeg_src(jpegdata);
+    }
+
+private:
+    void require(size_t bytes)
+    {
+        bytes = std::min(bytes, streamsize);
+        if (bytes <= available) {
+            return;
+        }
+
+        update(waitFor(bytes));
+    }
+
+    void update(const DownloadView &view)
+    {
+        buf = reinterpret_cast<unsigned char *>(const_cast<char *>(view.data));
+        streamsize = view.size;
+        streampos = std::min(streampos, streamsize);
+        available = view.available;
+    }
+
+    std::function<DownloadView(size_t)> waitFor;
+    size_t available = 0;
+};
+
+// whether a file on the camera is a raw file the driver can decode
+static bool isRawFile(const std::string &filename)
+{
+    return filename.substr(filename.find_last_of(".") + 1) == "RW2";
+}
+
 // declare an auto pointer to LumixCameraDriver
 static std::unique_ptr<LumixCameraDriver> lumix_driver(new LumixCameraDriver());
 
+// Opens the camera on the given port, null if it doesn't answer there. With a model gphoto goes
+// straight to its driver, without one it finds the driver for whatever is on the port.
+static Camera *openCameraOn(CameraAbilitiesList *abilitiesList, GPPortInfoList *portList, const std::string &model,
+                            const std::string &port, GPContext *context)
+{
+    Camera *camera;
+    GPPortInfo info;
+    int index = gp_port_info_list_lookup_path(portList, port.c_str());
+    if (index < GP_OK || gp_port_info_list_get_info(portList, index, &info) < GP_OK || gp_camera_new(&camera) < GP_OK) {
+        return nullptr;
+    }
+
+    int ret = gp_camera_set_port_info(camera, info);
+    if (ret == GP_OK && !model.empty()) {
+        CameraAbilities abilities;
+        int entry = gp_abilities_list_lookup_model(abilitiesList, model.c_str());
+        if (entry >= GP_OK && gp_abilities_list_get_abilities(abilitiesList, entry, &abilities) == GP_OK) {
+            ret = gp_camera_set_abilities(camera, abilities);
+        }
+    }
+    if (ret == GP_OK) {
+        ret = gp_camera_init(camera, context);
+    }
+    if (ret != GP_OK) {
+        gp_camera_free(camera);
+        return nullptr;
+    }
+
+    return camera;
+}
+
+// Reads the image size from the start of frame segment of a JPEG.
+static bool jpegSize(const uint8_t *data, size_t size, int &width, int &height)
+{
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+
+    size_t at = 2;
+    while (at + 9 <= size) {
+        if (data[at] != 0xFF) {
+            return false;
+        }
+        uint8_t marker = data[at + 1];
+        if (marker == 0xFF) {
+            // fill byte
+            at++;
+            continue;
+        }
+
+        // SOF0 to SOF15, apart from DHT, JPG and DAC which share the range
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            height = (data[at + 5] << 8) | data[at + 6];
+            width  = (data[at + 7] << 8) | data[at + 8];
+            return width > 0 && height > 0;
+        }
+        at += 2 + ((data[at + 2] << 8) | data[at + 3]);
+    }
+
+    return false;
+}
+
+// Describes the CFA cell at the visible origin of a raw file: the colour of each of its sites (0 = R, 1 = G, 2 = B)
+// in pattern, and the black level and gain that map each site to 16 bits. whiteBalance holds the multipliers to
+// scale the colours by (normalized so the weakest colour is left alone), or is null to leave them as they are.
+static CfaScale cfaScale(LibRaw &raw_processor, const float *whiteBalance, int pattern[4])
+{
+    const libraw_colordata_t &color = raw_processor.imgdata.color;
+
+    float multipliers[4] = {1, 1, 1, 1};
+    if (whiteBalance) {
+        float lowest = 0;
+        for (int c = 0; c < 4; c++) {
+            multipliers[c] = whiteBalance[c] > 0 ? whiteBalance[c] : whiteBalance[1];
+            lowest = c == 0 ? multipliers[c] : std::min(lowest, multipliers[c]);
+        }
+        for (int c = 0; c < 4; c++) {
+            multipliers[c] = lowest > 0 ? multipliers[c] / lowest : 1;
+        }
+    }
+
+    CfaScale scale;
+    for (int row = 0; row < 2; row++) {
+        for (int col = 0; col < 2; col++) {
+            int site = row * 2 + col;
+            int c = raw_processor.COLOR(row, col);
+            pattern[site] = c == 3 ? 1 : c;
+
+            float black = color.black + color.cblack[c];
+            if (color.cblack[4] > 0 && color.cblack[5] > 0) {
+                black += color.cblack[6 + (row % color.cblack[4]) * color.cblack[5] + col % color.cblack[5]];
+            }
+            scale.black[site] = black;
+            scale.gain[site] = color.maximum > black ? multipliers[c] * 65535.0f / (color.maximum - black) : 1;
+        }
+    }
+
+    return scale;
+}
+
+// One line of an exposure plan, e.g. "20x120s ISO800 light".
+struct PlanEntry
+{
+    int count = 1;
+    float duration = 0;
+    // 0 keeps the iso of the ISO property
+    int iso = 0;
+    INDI::CCDChip::CCD_FRAME frameType = INDI::CCDChip::LIGHT_FRAME;
+};
+
+// Parses a plan of comma or semicolon separated entries: a count and a duration ("20x120s", "30x1/4000s"),
+// optionally followed by an iso ("ISO800") and a frame type (light, dark, flat(s) or bias).
+static bool parsePlan(std::string text, std::vector<PlanEntry> &entries, std::string &error)
+{
+    // the multiplication sign is accepted as well
+    for (size_t at; (at = text.find("\xC3\x97")) != std::string::npos;) {
+        text.replace(at, 2, "x");
+    }
+    std::replace(text.begin(), text.end(), ';', ',');
+
+    std::istringstream plan(text);
+    std::string item;
+    while (std::getline(plan, item, ',')) {
+        std::istringstream tokens(item);
+        std::string token;
+        if (!(tokens >> token)) {
+            continue;
+        }
+
+        PlanEntry entry;
+        std::transform(token.begin(), token.end(), token.begin(), ::tolower);
+        size_t x = token.find('x');
+        char *end;
+        if (x != std::string::npos) {
+            entry.count = strtol(token.c_str(), &end, 10);
+            if (end != token.c_str() + x || entry.count < 1) {
+                error = "bad frame count in \"" + item + "\"";
+                return false;
+            }
+            token = token.substr(x + 1);
+        }
+        if (token.rfind("1/", 0) == 0) {
+            entry.duration = 1 / strtof(token.c_str() + 2, &end);
+        } else {
+            entry.duration = strtof(token.c_str(), &end);
+        }
+        if (end == token.c_str() || (*end && strcmp(end, "s")) || !(entry.duration > 0)) {
+            error = "bad duration in \"" + item + "\"";
+            return false;
+        }
+
+        while (tokens >> token) {
+            std::transform(token.begin(), token.end(), token.begin(), ::tolower);
+            if (token.rfind("iso", 0) == 0) {
+                entry.iso = atoi(token.c_str() + 3);
+            } else if (token == "light" || token == "lights") {
+                entry.frameType = INDI::CCDChip::LIGHT_FRAME;
+            } else if (token == "dark" || token == "darks") {
+                entry.frameType = INDI::CCDChip::DARK_FRAME;
+            } else if (token == "flat" || token == "flats") {
+                entry.frameType = INDI::CCDChip::FLAT_FRAME;
+            } else if (token == "bias") {
+                entry.frameType = INDI::CCDChip::BIAS_FRAME;
+            } else {
+                error = "unknown \"" + token + "\" in \"" + item + "\"";
+                return false;
+            }
+        }
+        entries.push_back(entry);
+    }
+
+    if (entries.empty()) {
+        error = "the plan is empty";
+        return false;
+    }
+    return true;
+}
+
 LumixCameraDriver::LumixCameraDriver()
 {
     setVersion(INDI_LUMIX_VERSION_MAJOR, INDI_LUMIX_VERSION_MINOR);
@@ -12,6 +276,7 @@ LumixCameraDriver::LumixCameraDriver()
 
 LumixCameraDriver::~LumixCameraDriver()
 {
+    stopPipeline();
 }
 
 const char * LumixCameraDriver::getDefaultName()
@@ -23,6 +288,28 @@ bool LumixCameraDriver::initProperties()
 {
     INDI::CCD::initProperties();
 
+    CameraPortTP[PORT].fill("PORT", "Port", "");
+    CameraPortTP[PORT_MODEL].fill("MODEL", "Model", "");
+
+    CameraPortTP.fill(
+        getDeviceName(),
+        "CAMERA_PORT",
+        "Camera Port",
+        OPTIONS_TAB,
+        IP_RW,
+        60,
+        IPS_IDLE
+    );
+
+    CameraPortTP.onUpdate([this] {
+        // used from the next connect on, an empty port has the driver look for the camera
+        CameraPortTP.setState(IPS_OK);
+        CameraPortTP.apply();
+        saveConfig(true, CameraPortTP.getName());
+    });
+
+    defineProperty(CameraPortTP);
+
     SaveOnCameraSP[SAVE_ON_CAMERA].fill(
         "SAVE_ON_CAMERA",
         "Save Images on Camera",
@@ -41,6 +328,7 @@ bool LumixCameraDriver::initProperties()
     );
 
     SaveOnCameraSP.onUpdate([this] {
+        saveOnCamera = SaveOnCameraSP.findOnSwitchIndex() == SAVE_ON_CAMERA;
         switch (SaveOnCameraSP.findOnSwitchIndex()) {
         case SAVE_ON_CAMERA:
             LOG_INFO("Set to save photos on camera.");
@@ -55,602 +343,2959 @@ bool LumixCameraDriver::initProperties()
 
     defineProperty(SaveOnCameraSP);
 
-    CameraInfoTP[MANUFACTURER].fill(
-        "MANUFACTURER",
-        "Manufacturer",
-        "Unknown"
+    PipelineSP[PIPELINE_ENABLED].fill(
+        "PIPELINE_ENABLED",
+        "Pipelined Capture",
+        ISS_OFF
     );
 
-    CameraInfoTP[MODEL].fill(
-        "MODEL",
-        "Model",
-        "Unknown"
+    PipelineSP.fill(
+        getDeviceName(),
+        "CAPTURE_PIPELINE",
+        "Capture Pipeline",
+        OPTIONS_TAB,
+        IP_RW,
+        ISR_ATMOST1,
+        5,
+        IPS_IDLE
     );
 
-    CameraInfoTP[SERIAL].fill(
-        "SERIAL",
-        "Serial Number",
-        "Unknown"
+    PipelineSP.onUpdate([this] {
+        pipelineEnabled = PipelineSP.findOnSwitchIndex() == PIPELINE_ENABLED;
+        if (pipelineEnabled) {
+            LOG_INFO("Pipelined capture enabled. The next frame is exposed while the previous one is processed.");
+        } else {
+            LOG_INFO("Pipelined capture disabled.");
+
+            // drop any frame that was exposed ahead of the client
+            std::lock_guard<std::mutex> lock(pipelineMutex);
+            dropSpeculation();
+        }
+
+        PipelineSP.setState(IPS_IDLE);
+        PipelineSP.apply();
+    });
+
+    defineProperty(PipelineSP);
+
+    PipelineFramesNP[0].fill("FRAMES_TO_COME", "Frames to come", "%.f", 0, 9999, 1, 0);
+
+    PipelineFramesNP.fill(
+        getDeviceName(),
+        "CAPTURE_PIPELINE_FRAMES",
+        "Pipeline Frames",
+        OPTIONS_TAB,
+        IP_RW,
+        60,
+        IPS_IDLE
     );
 
-    CameraInfoTP[VERSION].fill(
-        "VERSION",
-        "Camera Version",
-        "Unknown"
+    PipelineFramesNP.onUpdate([this] {
+        // the client tells how many exposures it will still ask for, every exposure it starts counts one down.
+        // The next frame is only exposed ahead while more are to come, so no sequence ends on a wasted frame
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        framesToCome = PipelineFramesNP[0].getValue();
+        if (framesToCome == 0) {
+            dropSpeculation();
+        }
+
+        PipelineFramesNP.setState(IPS_IDLE);
+        PipelineFramesNP.apply();
+    });
+
+    defineProperty(PipelineFramesNP);
+
+    ProcessingThreadsNP[0].fill(
+        "THREADS",
+        "Threads",
+        "%.f",
+        1,
+        std::max(1u, std::thread::hardware_concurrency()),
+        1,
+        processingThreadCount
     );
 
-    CameraInfoTP.fill(
+    ProcessingThreadsNP.fill(
         getDeviceName(),
-        "CAMERA_INFO",
-        "Camera Info",
-        INFO_TAB,
-        IP_RO,
+        "PROCESSING_THREADS",
+        "Processing Threads",
+        OPTIONS_TAB,
+        IP_RW,
         60,
         IPS_IDLE
     );
 
-    IsoNP.fill(
-        getDefaultName(),
-        "ISO_VALUE",
-        "ISO Value",
+    ProcessingThreadsNP.onUpdate([this] {
+        setProcessingThreads(ProcessingThreadsNP[0].getValue());
+        LOGF_INFO("Decoding images on %i processing thread(s).", (int)processingThreadCount);
+
+        ProcessingThreadsNP.setState(IPS_IDLE);
+        ProcessingThreadsNP.apply();
+    });
+
+    defineProperty(ProcessingThreadsNP);
+
+    BurstNP[0].fill("COUNT", "Frames", "%.f", 1, 9999, 1, 1);
+
+    BurstNP.fill(
+        getDeviceName(),
+        "BURST",
+        "Burst",
         MAIN_CONTROL_TAB,
         IP_RW,
         60,
         IPS_IDLE
     );
 
-    IsoNP.onUpdate([this] {
-        if (setIso(IsoNP[0].getValue())) {
-            IsoNP.setState(IPS_IDLE);
-        } else {
-            IsoNP.setState(IPS_ALERT);
-        }
-
-        IsoNP.apply();
+    BurstNP.onUpdate([this] {
+        // every exposure is taken this many times back to back, the frames are downloaded after the last one
+        int count = BurstNP[0].getValue();
+        LOGF_INFO(count > 1 ? "Exposures are taken as bursts of %i frames." : "Exposures are taken one frame at a time.", count);
 
-        int actual_iso;
-        if (getIso(&actual_iso)) {
-            IsoNP[0].setValue(actual_iso);
-        }
+        BurstNP.setState(IPS_IDLE);
+        BurstNP.apply();
     });
 
-    // set which capabilities the camera has
-    uint32_t cap = CCD_HAS_SHUTTER;
-    SetCCDCapability(cap);
+    defineProperty(BurstNP);
 
-    return true;
-}
+    PlanTP[0].fill("PLAN", "Plan", "");
 
-bool LumixCameraDriver::updateProperties()
-{
-    INDI::CCD::updateProperties();
+    PlanTP.fill(
+        getDeviceName(),
+        "EXPOSURE_PLAN",
+        "Exposure Plan",
+        MAIN_CONTROL_TAB,
+        IP_RW,
+        60,
+        IPS_IDLE
+    );
 
-    if (isConnected()) {
-        setCurrentPollingPeriod(100);
-        SetTimer(getCurrentPollingPeriod());
-    }
+    PlanTP.onUpdate([this] {
+        PlanTP.setState(IPS_IDLE);
+        PlanTP.apply();
+    });
 
-    return true;
-}
+    defineProperty(PlanTP);
 
-GPContext* LumixCameraDriver::create_context() {
-    GPContext *context = gp_context_new();
-    return context;
-}
+    PlanSP[PLAN_START].fill("START", "Start", ISS_OFF);
+    PlanSP[PLAN_ABORT].fill("ABORT", "Abort", ISS_OFF);
 
-bool LumixCameraDriver::connect_to_lumix_camera() {
-    CameraAbilitiesList *abilities_list;
-    CameraList *cameras;
-    int ret, i;
+    PlanSP.fill(
+        getDeviceName(),
+        "EXPOSURE_PLAN_CONTROL",
+        "Plan",
+        MAIN_CONTROL_TAB,
+        IP_RW,
+        ISR_ATMOST1,
+        60,
+        IPS_IDLE
+    );
 
-    camera = nullptr;
-    gpContext = create_context();
-    ret = gp_camera_new(&camera);
-    ret = gp_camera_init(camera, gpContext);
-    if (ret != GP_OK) {
-        LOG_ERROR("No camera found. Ensure it's connected and powered on.");
-        gp_camera_free(camera);
-        return false;
-    }
+    PlanSP.onUpdate([this] {
+        int action = PlanSP.findOnSwitchIndex();
+        PlanSP.reset();
+        if (action == PLAN_START) {
+            PlanSP.setState(startPlan(PlanTP[0].getText()) ? IPS_BUSY : IPS_ALERT);
+        } else if (action == PLAN_ABORT) {
+            AbortExposure();
+            PlanSP.setState(IPS_IDLE);
+        }
+        PlanSP.apply();
+    });
 
-    if (!load_camera_widgets()) {
-        LOG_ERROR("Failed to load camera widgets!");
-        return false;
-    }
+    defineProperty(PlanSP);
 
-    if (!load_camera_info()) {
-        LOG_ERROR("Failed to load camera info!");
-        return false;
-    }
+    PlanOrderSP[PLAN_GROUP].fill("GROUP", "Group by settings", ISS_ON);
 
-    // // Create abilities list
-    // ret = gp_abilities_list_new(&abilities_list);
-    // if (ret < GP_OK) return false;
-
-    // // Load all supported camera abilities
-    // ret = gp_abilities_list_load(abilities_list, gpContext);
-    // if (ret < GP_OK) return false;
-
-    // // Detect all cameras
-    // ret = gp_abilities_list_detect(abilities_list, NULL, cameras, gpContext);
-    // if (ret < GP_OK) return false;
-
-    // // Loop through the detected cameras
-    // for (i = 0; i < gp_list_count(cameras); i++) {
-    //     const char *name, *value;
-    //     CameraAbilities a;
-        
-    //     // Get camera name and port
-    //     gp_list_get_name(cameras, i, &name);
-    //     gp_list_get_value(cameras, i, &value);
-
-    //     // Check if this camera is a Panasonic/Lumix
-    //     ret = gp_abilities_list_get_abilities(abilities_list, 0, &a);
-    //     if (ret == GP_OK) {
-    //         if (strstr(a.model, "Panasonic") || strstr(a.model, "Lumix")) {
-    //             // Here we found a Panasonic/Lumix camera
-    //             GPPortInfo port_info;
-    //             gp_port_info_new(&port_info);
-                
-    //             // Set port information for the camera
-    //             gp_port_info_set_path(port_info, value);
-    //             gp_camera_set_port_info(camera, port_info);
-
-    //             // Initialize the camera with the specified port
-    //             ret = gp_camera_init(camera, gpContext);
-    //             if (ret < GP_OK) {
-    //                 LOG_ERROR("Camera initialization failed");
-    //             } else {
-    //                 // Camera is initialized successfully!
-    //                 gp_abilities_list_free(abilities_list);
-    //                 gp_list_free(cameras);
-
-    //                 // load the widgets
-    //                 return load_camera_widgets();
-    //             }
-    //         }
-    //     }
-    // }
+    PlanOrderSP.fill(
+        getDeviceName(),
+        "EXPOSURE_PLAN_ORDER",
+        "Plan Order",
+        MAIN_CONTROL_TAB,
+        IP_RW,
+        ISR_ATMOST1,
+        60,
+        IPS_IDLE
+    );
 
-    // gp_abilities_list_free(abilities_list);
-    // gp_list_free(cameras);
-    return true;
-}
+    PlanOrderSP.onUpdate([this] {
+        PlanOrderSP.setState(IPS_IDLE);
+        PlanOrderSP.apply();
+    });
 
-bool LumixCameraDriver::load_camera_widgets() {
-    // get config widget
-    int ret = gp_camera_get_config(camera, &config, gpContext);
-    if (ret != GP_OK) {
-        LOG_ERROR("Could not get camera config.");
-        return false;
-    }
+    defineProperty(PlanOrderSP);
 
-#pragma region ShutterSpeedSetup
-    // get shutter speed widget
-    ret = gp_widget_get_child_by_name(config, "shutterspeed", &ss);
-    if (ret != GP_OK) {
-        LOG_ERROR("Could not get camera shutter speed widget.");
-        return false;
-    }
+    PlanProgressNP[PLAN_DONE].fill("DONE", "Done", "%.f", 0, 1e6, 1, 0);
+    PlanProgressNP[PLAN_TOTAL].fill("TOTAL", "Total", "%.f", 0, 1e6, 1, 0);
 
-    // ensure ss widget is a RADIO widget
-    CameraWidgetType type;
-    ret = gp_widget_get_type(ss, &type);
-    if (ret != GP_OK || type != GP_WIDGET_RADIO) {
-        LOGF_ERROR("Shutter speed widget is not a RADIO widget, rather it has the value %i.", type);
-        return false;
-    }
+    PlanProgressNP.fill(
+        getDeviceName(),
+        "EXPOSURE_PLAN_PROGRESS",
+        "Plan Progress",
+        MAIN_CONTROL_TAB,
+        IP_RO,
+        60,
+        IPS_IDLE
+    );
 
-    // if shutter speed is bulb, set it to 1 second (otherwise all choices will be incorrect)
+    defineProperty(PlanProgressNP);
+
+    BurstProgressNP[BURST_CAPTURED].fill("CAPTURED", "Captured", "%.f", 0, 9999, 1, 0);
+    BurstProgressNP[BURST_DOWNLOADED].fill("DOWNLOADED", "Downloaded", "%.f", 0, 9999, 1, 0);
+    BurstProgressNP[BURST_PROCESSED].fill("PROCESSED", "Processed", "%.f", 0, 9999, 1, 0);
+
+    BurstProgressNP.fill(
+        getDeviceName(),
+        "BURST_PROGRESS",
+        "Burst Progress",
+        MAIN_CONTROL_TAB,
+        IP_RO,
+        60,
+        IPS_IDLE
+    );
+
+    defineProperty(BurstProgressNP);
+
+    CameraHealthNP[STALL_COUNT].fill("STALLS", "Stalls", "%.f", 0, 1e6, 1, 0);
+    CameraHealthNP[RECONNECT_COUNT].fill("RECONNECTS", "Reconnects", "%.f", 0, 1e6, 1, 0);
+    CameraHealthNP[RECONNECT_TIME].fill("RECONNECT_TIME", "Last Reconnect (s)", "%.2f", 0, 1e6, 0, 0);
+
+    CameraHealthNP.fill(
+        getDeviceName(),
+        "CAMERA_HEALTH",
+        "Camera Health",
+        INFO_TAB,
+        IP_RO,
+        60,
+        IPS_IDLE
+    );
+
+    defineProperty(CameraHealthNP);
+
+    CameraQueueNP[QUEUE_DEPTH].fill("QUEUE_DEPTH", "Queued Commands", "%.f", 0, 1000, 1, 0);
+    CameraQueueNP[COMMAND_WAIT].fill("COMMAND_WAIT", "Last Wait (ms)", "%.1f", 0, 1e6, 0, 0);
+    CameraQueueNP[COMMAND_TIME].fill("COMMAND_TIME", "Last Run (ms)", "%.1f", 0, 1e6, 0, 0);
+
+    CameraQueueNP.fill(
+        getDeviceName(),
+        "CAMERA_QUEUE",
+        "Camera Commands",
+        INFO_TAB,
+        IP_RO,
+        60,
+        IPS_IDLE
+    );
+
+    defineProperty(CameraQueueNP);
+
+    FrameQualitySP[QUALITY_FULL].fill("FULL", "Full", ISS_ON);
+    FrameQualitySP[QUALITY_BILINEAR].fill("BILINEAR", "Bilinear", ISS_OFF);
+    FrameQualitySP[QUALITY_HALF_SIZE].fill("HALF_SIZE", "Half size", ISS_OFF);
+    FrameQualitySP[QUALITY_LINEAR].fill("LINEAR", "Linear", ISS_OFF);
+    FrameQualitySP[QUALITY_QUICK_LOOK].fill("QUICK_LOOK", "Quick look", ISS_OFF);
+
+    FrameQualitySP.fill(
+        getDeviceName(),
+        "FRAME_QUALITY",
+        "Frame Quality",
+        IMAGE_SETTINGS_TAB,
+        IP_RW,
+        ISR_1OFMANY,
+        60,
+        IPS_IDLE
+    );
+
+    FrameQualitySP.onUpdate([this] {
+        switch (FrameQualitySP.findOnSwitchIndex()) {
+        case QUALITY_BILINEAR:
+            LOG_INFO("Frames are demosaiced with bilinear interpolation.");
+            break;
+        case QUALITY_HALF_SIZE:
+            LOG_INFO("Every 2x2 cell of the Bayer mosaic becomes one RGB pixel, without interpolation.");
+            break;
+        case QUALITY_LINEAR:
+            LOG_INFO("Frames are black subtracted and demosaiced into linear RGB, without brightening or gamma.");
+            break;
+        case QUALITY_QUICK_LOOK:
+            LOG_INFO("Sending the camera's JPEG preview of every frame instead of processing the raw file.");
+            break;
+        default:
+            LOG_INFO("Sending fully processed frames.");
+        }
+
+        // half size frames hold a quarter of the pixels and are always RGB
+        UpdateCCDFrame(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+
+        FrameQualitySP.setState(IPS_IDLE);
+        FrameQualitySP.apply();
+    });
+
+    defineProperty(FrameQualitySP);
+
+    WhiteBalanceSP[WHITE_BALANCE_CAMERA].fill("CAMERA_WB", "Camera white balance", ISS_OFF);
+
+    WhiteBalanceSP.fill(
+        getDeviceName(),
+        "LINEAR_WHITE_BALANCE",
+        "Linear White Balance",
+        IMAGE_SETTINGS_TAB,
+        IP_RW,
+        ISR_ATMOST1,
+        60,
+        IPS_IDLE
+    );
+
+    WhiteBalanceSP.onUpdate([this] {
+        WhiteBalanceSP.setState(IPS_IDLE);
+        WhiteBalanceSP.apply();
+    });
+
+    defineProperty(WhiteBalanceSP);
+
+    LinearDemosaicSP[DEMOSAIC_BILINEAR].fill("BILINEAR", "Bilinear", ISS_ON);
+    LinearDemosaicSP[DEMOSAIC_VNG].fill("VNG", "VNG", ISS_OFF);
+
+    LinearDemosaicSP.fill(
+        getDeviceName(),
+        "LINEAR_DEMOSAIC",
+        "Linear Demosaic",
+        IMAGE_SETTINGS_TAB,
+        IP_RW,
+        ISR_1OFMANY,
+        60,
+        IPS_IDLE
+    );
+
+    LinearDemosaicSP.onUpdate([this] {
+        LinearDemosaicSP.setState(IPS_IDLE);
+        LinearDemosaicSP.apply();
+    });
+
+    defineProperty(LinearDemosaicSP);
+
+    TileCompressSP[TILE_COMPRESS].fill("TILE_COMPRESS", "Tile compress (fpack)", ISS_OFF);
+
+    TileCompressSP.fill(
+        getDeviceName(),
+        "FRAME_COMPRESSION",
+        "Frame Compression",
+        IMAGE_SETTINGS_TAB,
+        IP_RW,
+        ISR_ATMOST1,
+        60,
+        IPS_IDLE
+    );
+
+    TileCompressSP.onUpdate([this] {
+        if (TileCompressSP.findOnSwitchIndex() == TILE_COMPRESS) {
+            LOG_INFO("FITS frames are uploaded tile compressed (.fits.fz), gzipped on the processing threads.");
+        }
+        TileCompressSP.setState(IPS_IDLE);
+        TileCompressSP.apply();
+    });
+
+    defineProperty(TileCompressSP);
+
+    TileCompressionNP[COMPRESSION_RATIO].fill("RATIO", "Ratio", "%.2f", 0, 100, 0, 0);
+    TileCompressionNP[COMPRESSION_THROUGHPUT].fill("THROUGHPUT", "Throughput (MB/s)", "%.0f", 0, 1e5, 0, 0);
+
+    TileCompressionNP.fill(
+        getDeviceName(),
+        "FRAME_COMPRESSION_STATS",
+        "Last Compression",
+        IMAGE_SETTINGS_TAB,
+        IP_RO,
+        60,
+        IPS_IDLE
+    );
+
+    defineProperty(TileCompressionNP);
+
+    RawFollowUpSP[RAW_FOLLOW_UP].fill("RAW_FOLLOW_UP", "Upload raw file after quick look", ISS_OFF);
+
+    RawFollowUpSP.fill(
+        getDeviceName(),
+        "QUICK_LOOK_RAW",
+        "Quick Look Raw",
+        IMAGE_SETTINGS_TAB,
+        IP_RW,
+        ISR_ATMOST1,
+        60,
+        IPS_IDLE
+    );
+
+    RawFollowUpSP.onUpdate([this] {
+        RawFollowUpSP.setState(IPS_IDLE);
+        RawFollowUpSP.apply();
+    });
+
+    defineProperty(RawFollowUpSP);
+
+    RawFrameBP[0].fill("RAW", "Raw File", nullptr);
+
+    RawFrameBP.fill(
+        getDeviceName(),
+        "QUICK_LOOK_RAW_FILE",
+        "Quick Look Raw File",
+        IMAGE_SETTINGS_TAB,
+        IP_RO,
+        60,
+        IPS_IDLE
+    );
+
+    defineProperty(RawFrameBP);
+
+    CameraShotsSP[CAMERA_SHOTS].fill("CAMERA_SHOTS", "Upload shots taken on the camera", ISS_OFF);
+
+    CameraShotsSP.fill(
+        getDeviceName(),
+        "CAMERA_SHOTS",
+        "Camera Shots",
+        IMAGE_SETTINGS_TAB,
+        IP_RW,
+        ISR_ATMOST1,
+        60,
+        IPS_IDLE
+    );
+
+    CameraShotsSP.onUpdate([this] {
+        // shots taken with the camera's own shutter button are nobody's exposure, so they never go through the
+        // CCD image. Without this they are ignored (and deleted unless photos are kept on the camera)
+        sendCameraShots = CameraShotsSP.findOnSwitchIndex() == CAMERA_SHOTS;
+        LOG_INFO(sendCameraShots ? "Raw files of shots taken on the camera are uploaded as they are."
+                                 : "Shots taken on the camera are ignored.");
+
+        CameraShotsSP.setState(IPS_IDLE);
+        CameraShotsSP.apply();
+    });
+
+    defineProperty(CameraShotsSP);
+
+    CameraShotBP[0].fill("RAW", "Raw File", nullptr);
+
+    CameraShotBP.fill(
+        getDeviceName(),
+        "CAMERA_SHOT_FILE",
+        "Camera Shot File",
+        IMAGE_SETTINGS_TAB,
+        IP_RO,
+        60,
+        IPS_IDLE
+    );
+
+    defineProperty(CameraShotBP);
+
+    RawBayerSP[RAW_BAYER].fill(
+        "RAW_BAYER",
+        "Raw Bayer (CFA)",
+        ISS_OFF
+    );
+
+    RawBayerSP.fill(
+        getDeviceName(),
+        "RAW_BAYER_OUTPUT",
+        "Raw Output",
+        IMAGE_SETTINGS_TAB,
+        IP_RW,
+        ISR_ATMOST1,
+        5,
+        IPS_IDLE
+    );
+
+    RawBayerSP.onUpdate([this] {
+        if (RawBayerSP.findOnSwitchIndex() == RAW_BAYER) {
+            LOG_INFO("Sending raw Bayer (CFA) frames without demosaicing.");
+        } else {
+            LOG_INFO("Sending demosaiced RGB frames.");
+        }
+
+        // this changes the number of channels in the frame
+        UpdateCCDFrame(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+
+        RawBayerSP.setState(IPS_IDLE);
+        RawBayerSP.apply();
+    });
+
+    defineProperty(RawBayerSP);
+
+    BinModeSP[BIN_AVERAGE].fill(
+        "BIN_AVERAGE",
+        "Average",
+        ISS_ON
+    );
+
+    BinModeSP[BIN_SUM].fill(
+        "BIN_SUM",
+        "Sum",
+        ISS_OFF
+    );
+
+    BinModeSP[BIN_SUPERPIXEL].fill(
+        "BIN_SUPERPIXEL",
+        "Bayer Superpixel",
+        ISS_OFF
+    );
+
+    BinModeSP.fill(
+        getDeviceName(),
+        "BIN_MODE",
+        "Bin Mode",
+        IMAGE_SETTINGS_TAB,
+        IP_RW,
+        ISR_1OFMANY,
+        5,
+        IPS_IDLE
+    );
+
+    BinModeSP.onUpdate([this] {
+        switch (BinModeSP.findOnSwitchIndex()) {
+        case BIN_SUM:
+            LOG_INFO("Binned pixels are summed.");
+            break;
+        case BIN_SUPERPIXEL:
+            LOG_INFO("Binning collapses the Bayer mosaic into RGB superpixels without demosaicing.");
+            if (PrimaryCCD.getBinX() % 2 != 0 || PrimaryCCD.getBinY() % 2 != 0) {
+                LOG_WARN("Superpixel binning only applies to even binning factors.");
+            }
+            break;
+        default:
+            LOG_INFO("Binned pixels are averaged.");
+        }
+
+        // superpixels are always RGB, so this can change the number of channels
+        UpdateCCDFrame(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+
+        BinModeSP.setState(IPS_IDLE);
+        BinModeSP.apply();
+    });
+
+    defineProperty(BinModeSP);
+
+    CameraInfoTP[MANUFACTURER].fill(
+        "MANUFACTURER",
+        "Manufacturer",
+        "Unknown"
+    );
+
+    CameraInfoTP[MODEL].fill(
+        "MODEL",
+        "Model",
+        "Unknown"
+    );
+
+    CameraInfoTP[SERIAL].fill(
+        "SERIAL",
+        "Serial Number",
+        "Unknown"
+    );
+
+    CameraInfoTP[VERSION].fill(
+        "VERSION",
+        "Camera Version",
+        "Unknown"
+    );
+
+    CameraInfoTP.fill(
+        getDeviceName(),
+        "CAMERA_INFO",
+        "Camera Info",
+        INFO_TAB,
+        IP_RO,
+        60,
+        IPS_IDLE
+    );
+
+    NativeFrameTP[NATIVE_FILE].fill("FILE", "File", "");
+    NativeFrameTP[NATIVE_INSTRUMENT].fill("INSTRUME", "Instrument", "");
+    NativeFrameTP[NATIVE_EXPOSURE].fill("EXPTIME", "Exposure (s)", "");
+    NativeFrameTP[NATIVE_ISO].fill("ISOSPEED", "ISO", "");
+
+    // native uploads carry no FITS header, so what it would have said goes along in here
+    NativeFrameTP.fill(
+        getDeviceName(),
+        "NATIVE_FRAME_INFO",
+        "Native Frame Info",
+        IMAGE_SETTINGS_TAB,
+        IP_RO,
+        60,
+        IPS_IDLE
+    );
+
+    defineProperty(NativeFrameTP);
+
+    IsoNP.fill(
+        getDefaultName(),
+        "ISO_VALUE",
+        "ISO Value",
+        MAIN_CONTROL_TAB,
+        IP_RW,
+        60,
+        IPS_IDLE
+    );
+
+    IsoNP.onUpdate([this] {
+        // snap the iso to what the camera supports, exposures take it from their settings anyway
+        // so the camera only gets it now if it isn't busy
+        std::string value;
+        if (getIsoChoiceValue(IsoNP[0].getValue(), value)) {
+            int iso = std::stoi(value);
+            IsoNP[0].setValue(iso);
+            IsoNP.setState(IPS_IDLE);
+
+            std::lock_guard<std::mutex> lock(pipelineMutex);
+            queueCameraCommand(COMMAND_CONFIG, "iso", [this, iso] {
+                if (setIso(iso)) {
+                    applyConfig();
+                }
+            });
+        } else {
+            IsoNP.setState(IPS_ALERT);
+        }
+
+        IsoNP.apply();
+    });
+
+    // set which capabilities the camera has
+    // (the Bayer pattern is only written to FITS headers for 2 axis images, i.e. raw CFA frames)
+    uint32_t cap = CCD_HAS_SHUTTER | CCD_HAS_BAYER | CCD_CAN_BIN | CCD_CAN_SUBFRAME | CCD_HAS_STREAMING;
+    SetCCDCapability(cap);
+
+    return true;
+}
+
+bool LumixCameraDriver::updateProperties()
+{
+    INDI::CCD::updateProperties();
+
+    if (isConnected()) {
+        setCurrentPollingPeriod(100);
+        SetTimer(getCurrentPollingPeriod());
+    }
+
+    return true;
+}
+
+GPContext* LumixCameraDriver::create_context() {
+    GPContext *context = gp_context_new();
+    gp_context_set_cancel_func(context, &LumixCameraDriver::cancel_func, this);
+    return context;
+}
+
+GPContextFeedback LumixCameraDriver::cancel_func(GPContext *, void *data)
+{
+    LumixCameraDriver *driver = static_cast<LumixCameraDriver *>(data);
+    return driver->cancelIo && !driver->closingShutter ? GP_CONTEXT_FEEDBACK_CANCEL : GP_CONTEXT_FEEDBACK_OK;
+}
+
+Camera *LumixCameraDriver::probeCameraPorts(std::string &port, std::string &model) {
+    CameraList *detected;
+    std::vector<std::pair<std::string, std::string>> candidates;
+    gp_list_new(&detected);
+    if (gp_abilities_list_detect(abilitiesList.get(), portList.get(), detected, gpContext) >= GP_OK) {
+        // Panasonic cameras are preferred when something else is plugged in too
+        bool lumixOnly = false;
+        for (int i = 0; i < gp_list_count(detected); i++) {
+            const char *name, *path;
+            gp_list_get_name(detected, i, &name);
+            gp_list_get_value(detected, i, &path);
+            bool lumix = strstr(name, "Panasonic") || strstr(name, "Lumix");
+            if (lumix && !lumixOnly) {
+                candidates.clear();
+                lumixOnly = true;
+            }
+            if (lumix || !lumixOnly) {
+                candidates.push_back({name, path});
+            }
+        }
+    }
+    gp_list_free(detected);
+    if (candidates.empty()) {
+        return nullptr;
+    }
+
+    // the candidates are opened at the same time and the first one to answer is used, probes that
+    // are still running when the driver moves on close their camera once they get it
+    struct PortProbe
+    {
+        std::mutex mutex;
+        std::condition_variable done;
+        Camera *camera = nullptr;
+        std::string port;
+        std::string model;
+        size_t pending = 0;
+        bool closed = false;
+    };
+    auto probe = std::make_shared<PortProbe>();
+    probe->pending = candidates.size();
+    for (auto &candidate : candidates) {
+        LOGF_DEBUG("Probing %s on %s", candidate.first.c_str(), candidate.second.c_str());
+        std::thread([probe, candidate, abilities = abilitiesList, ports = portList] {
+            GPContext *context = gp_context_new();
+            Camera *found = openCameraOn(abilities.get(), ports.get(), candidate.first, candidate.second, context);
+
+            std::lock_guard<std::mutex> lock(probe->mutex);
+            probe->pending--;
+            if (found && !probe->camera && !probe->closed) {
+                probe->camera = found;
+                probe->model = candidate.first;
+                probe->port = candidate.second;
+            } else if (found) {
+                gp_camera_exit(found, context);
+                gp_camera_free(found);
+            }
+            gp_context_unref(context);
+            probe->done.notify_all();
+        }).detach();
+    }
+
+    std::unique_lock<std::mutex> lock(probe->mutex);
+    probe->done.wait_for(lock, std::chrono::milliseconds(PORT_PROBE_TIMEOUT_MS), [&probe] {
+        return probe->camera || probe->pending == 0;
+    });
+    probe->closed = true;
+    if (!probe->camera && probe->pending > 0) {
+        LOGF_WARN("%i camera(s) did not answer within %i s.", (int)probe->pending, PORT_PROBE_TIMEOUT_MS / 1000);
+    }
+    port = probe->port;
+    model = probe->model;
+    return probe->camera;
+}
+
+bool LumixCameraDriver::open_camera() {
+    camera = nullptr;
+    gpContext = create_context();
+
+    if (!abilitiesList) {
+        CameraAbilitiesList *abilities;
+        gp_abilities_list_new(&abilities);
+        abilitiesList.reset(abilities, [](CameraAbilitiesList *list) { gp_abilities_list_free(list); });
+        gp_abilities_list_load(abilities, gpContext);
+    }
+    if (!portList) {
+        GPPortInfoList *ports;
+        gp_port_info_list_new(&ports);
+        portList.reset(ports, [](GPPortInfoList *list) { gp_port_info_list_free(list); });
+        gp_port_info_list_load(ports);
+    }
+
+    // the port the camera was last found on goes first, the others are only probed when it isn't there
+    std::string port, model;
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        port = cameraPort;
+        model = cameraModel;
+    }
+    if (!port.empty()) {
+        camera = openCameraOn(abilitiesList.get(), portList.get(), model, port, gpContext);
+        if (!camera) {
+            LOGF_INFO("No camera answered on %s, looking for it on the other ports.", port.c_str());
+        }
+    }
+    if (!camera) {
+        camera = probeCameraPorts(port, model);
+    }
+    if (!camera) {
+        LOG_ERROR("No camera found. Ensure it's connected and powered on.");
+        gp_context_unref(gpContext);
+        return false;
+    }
+
+    LOGF_INFO("Found %s on %s", model.empty() ? "the camera" : model.c_str(), port.c_str());
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        cameraPortChanged = cameraPortChanged || port != cameraPort || model != cameraModel;
+        cameraPort = port;
+        cameraModel = model;
+    }
+
+    if (!load_camera_widgets()) {
+        LOG_ERROR("Failed to load camera widgets!");
+        // reconnects keep calling this, so a camera that answers but has no configuration mustn't leak
+        gp_camera_exit(camera, gpContext);
+        gp_camera_free(camera);
+        gp_context_unref(gpContext);
+        camera = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool LumixCameraDriver::connect_to_lumix_camera() {
+    if (!open_camera()) {
+        return false;
+    }
+
+    // the journal of files to delete lives next to the capability cache
+    deleteJournal.clear();
+    if (!capabilityCache.empty()) {
+        deleteJournal = capabilityCache.substr(0, capabilityCache.rfind('.')) + ".delete";
+    }
+    loadDeleteJournal();
+
+    if (!load_camera_info()) {
+        LOG_ERROR("Failed to load camera info!");
+        return false;
+    }
+
+    return true;
+}
+
+void LumixCameraDriver::updateCameraPort() {
+    // the port is remembered for the next connect once the camera was found on it
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (!cameraPortChanged) {
+            return;
+        }
+        cameraPortChanged = false;
+        CameraPortTP[PORT].setText(cameraPort);
+        CameraPortTP[PORT_MODEL].setText(cameraModel);
+    }
+
+    CameraPortTP.setState(IPS_OK);
+    CameraPortTP.apply();
+    saveConfig(true, CameraPortTP.getName());
+}
+
+bool LumixCameraDriver::saveConfigItems(FILE *fp) {
+    INDI::CCD::saveConfigItems(fp);
+
+    CameraPortTP.save(fp);
+
+    return true;
+}
+
+bool LumixCameraDriver::load_camera_widgets() {
+    freeCameraWidgets();
+
+    // the widgets now hold what is on the camera
+    cameraConfig.clear();
+    pendingConfig.clear();
+
+    // a camera that was connected before has its choices cached, so only the settings the driver changes
+    // are read from it, each on its own
+    capabilityCache = capabilityCachePath();
+    bool cached = !capabilityCache.empty() && loadCapabilityCache(capabilityCache);
+    int ret;
+    if (cached) {
+        ret = gp_camera_get_single_config(camera, "shutterspeed", &ss, gpContext);
+        if (ret == GP_OK) {
+            ret = gp_camera_get_single_config(camera, "iso", &iso_w, gpContext);
+        }
+        if (ret == GP_OK && !bulbChoice.empty() && gp_camera_get_single_config(camera, "bulb", &bulb_w, gpContext) != GP_OK) {
+            bulb_w = nullptr;
+            bulbChoice.clear();
+        }
+        if (ret != GP_OK) {
+            LOG_WARN("Could not read the camera settings on their own, reading the whole configuration.");
+            freeCameraWidgets();
+            cached = false;
+        }
+    }
+    capabilitiesCached = cached;
+
+    if (!cached) {
+        // get config widget
+        ret = gp_camera_get_config(camera, &config, gpContext);
+        if (ret != GP_OK) {
+            LOG_ERROR("Could not get camera config.");
+            return false;
+        }
+
+        // get shutter speed widget
+        ret = gp_widget_get_child_by_name(config, "shutterspeed", &ss);
+        if (ret != GP_OK) {
+            LOG_ERROR("Could not get camera shutter speed widget.");
+            return false;
+        }
+
+        // get iso widget
+        ret = gp_widget_get_child_by_name(config, "iso", &iso_w);
+        if (ret != GP_OK) {
+            LOG_ERROR("Could not get camera iso widget.");
+            return false;
+        }
+    }
+
+#pragma region ShutterSpeedSetup
+    // ensure ss widget is a RADIO widget
+    CameraWidgetType type;
+    ret = gp_widget_get_type(ss, &type);
+    if (ret != GP_OK || type != GP_WIDGET_RADIO) {
+        LOGF_ERROR("Shutter speed widget is not a RADIO widget, rather it has the value %i.", type);
+        return false;
+    }
+
+    // if shutter speed is bulb, set it to 1 second (otherwise all choices will be incorrect)
+    const char *value;
+    ret = gp_widget_get_value(ss, &value);
+    if (ret != GP_OK) {
+        LOG_ERROR("Could not get current camera shutter speed setting.");
+        return false;
+    }
+    cameraConfig["shutterspeed"] = value;
+    if (!strcmp(value, "bulb")) {
+        if (!setConfigValue(ss, "1")) {
+            LOG_ERROR("Please disable bulb mode or use a shutter speed other than bulb then reconnect the camera.");
+            return false;
+        }
+    }
+
+    if (!cached) {
+        // the first choice is usually bulb mode, exposures are timed by the driver in it when the camera
+        // lets the shutter be opened and closed
+        bulb_w = nullptr;
+        bulbChoice.clear();
+        const char *first;
+        if (gp_widget_count_choices(ss) > 0 && gp_widget_get_choice(ss, 0, &first) == GP_OK &&
+            gp_widget_get_child_by_name(config, "bulb", &bulb_w) == GP_OK) {
+            bulbChoice = first;
+        } else {
+            bulb_w = nullptr;
+        }
+
+        readShutterChoices(ss, ss_choices);
+    }
+
+    if (!bulbChoice.empty()) {
+        LOGF_INFO("Bulb mode available using shutter speed choice %s", bulbChoice.c_str());
+    } else {
+        LOG_INFO("Bulb mode is not available, exposures are limited to the camera's shutter speeds.");
+    }
+#pragma endregion ShutterSpeedSetup
+
+#pragma region ISOSetup
+    // ensure iso widget is a RADIO widget
+    ret = gp_widget_get_type(iso_w, &type);
+    if (ret != GP_OK || type != GP_WIDGET_RADIO) {
+        LOGF_ERROR("Iso widget is not a RADIO widget, rather it has the value %i.", type);
+        return false;
+    }
+
+    ret = gp_widget_get_value(iso_w, &value);
+    if (ret == GP_OK) {
+        cameraConfig["iso"] = value;
+    }
+
+    if (!cached) {
+        std::map<int, std::string> choices;
+        readIsoChoices(iso_w, choices);
+
+        std::lock_guard<std::mutex> lock(choicesMutex);
+        iso_choices = std::move(choices);
+    }
+#pragma endregion ISOSetup
+
+    if (ss_choices.empty() || iso_choices.empty()) {
+        LOG_ERROR("The camera reported no usable shutter speeds or iso values.");
+        return false;
+    }
+    LOGF_INFO("%i shutter speeds from %g to %g s, %i iso values from %i to %i", (int)ss_choices.size(), ss_choices.begin()->first,
+              std::prev(ss_choices.end())->first, (int)iso_choices.size(), iso_choices.begin()->first,
+              std::prev(iso_choices.end())->first);
+
+    if (!cached) {
+        readCameraInfo(config, cameraInfo);
+        saveCapabilityCache();
+    }
+
+    return true;
+}
+
+void LumixCameraDriver::freeCameraWidgets() {
+    // the choice tables own their strings, so the widgets can go
+    if (config) {
+        gp_widget_free(config);
+    } else {
+        if (ss) {
+            gp_widget_free(ss);
+        }
+        if (iso_w) {
+            gp_widget_free(iso_w);
+        }
+        if (bulb_w) {
+            gp_widget_free(bulb_w);
+        }
+    }
+    config = nullptr;
+    ss = nullptr;
+    iso_w = nullptr;
+    bulb_w = nullptr;
+}
+
+void LumixCameraDriver::readShutterChoices(CameraWidget *widget, std::map<float, std::string> &choices) {
+    choices.clear();
+
+    // go through all possible shutter speed values (skip first choice as it is usually bulb mode in a weird format)
+    int count = gp_widget_count_choices(widget);
+    for (int i = 1; i < count; i++) {
+        const char *choice;
+        int ret = gp_widget_get_choice(widget, i, &choice);
+        if (ret != GP_OK) {
+            LOG_ERROR("Failed to get possible shutter speed value.");
+            continue;
+        }
+        std::string choice_string = std::string(choice);
+        float choice_float = 0;
+        try {
+            if (choice_string.rfind("1/", 0) == 0) {
+                choice_float = 1.0 / std::stof(choice_string.substr(2));
+            } else {
+                choice_float = std::stof(choice_string);
+            }
+        } catch (const std::exception &e) {
+            LOGF_DEBUG("Skipping shutter speed choice %i (%s)", i, choice);
+            continue;
+        }
+        choices.insert({choice_float, choice});
+        LOGF_DEBUG("Possible Shutter Speed Value for choice %i: %f (%s)", i, choice_float, choice);
+    }
+}
+
+void LumixCameraDriver::readIsoChoices(CameraWidget *widget, std::map<int, std::string> &choices) {
+    choices.clear();
+
+    // go through all possible iso values
+    int count = gp_widget_count_choices(widget);
+    for (int i = 0; i < count; i++) {
+        const char *choice;
+        int ret = gp_widget_get_choice(widget, i, &choice);
+        if (ret != GP_OK) {
+            LOG_ERROR("Failed to get possible iso value.");
+            continue;
+        }
+        int choice_int;
+        try {
+            choice_int = std::stoi(std::string(choice));
+        } catch (const std::exception &e) {
+            LOGF_DEBUG("Skipping iso choice %i (%s)", i, choice);
+            continue;
+        }
+        choices.insert({choice_int, choice});
+        LOGF_DEBUG("Possible iso Value for choice %i: %i", i, choice_int);
+    }
+}
+
+void LumixCameraDriver::readCameraInfo(CameraWidget *tree, std::string info[4]) {
+    static const char *const names[] = {"manufacturer", "cameramodel", "serialnumber", "deviceversion"};
+    static const char *const labels[] = {"manufacturer name", "camera model", "serial number", "device version"};
+
+    for (int i = MANUFACTURER; i <= VERSION; i++) {
+        CameraWidget *child;
+        const char *value;
+        info[i] = "Unknown";
+        if (gp_widget_get_child_by_name(tree, names[i], &child) != GP_OK) {
+            LOGF_ERROR("The %s field was not found.", labels[i]);
+        } else if (gp_widget_get_value(child, &value) != GP_OK) {
+            LOGF_ERROR("Failed to get the %s.", labels[i]);
+        } else {
+            info[i] = value;
+        }
+    }
+}
+
+std::string LumixCameraDriver::capabilityCachePath() {
+    // cameras are told apart by model and serial number, both can be read without walking the configuration
+    CameraAbilities abilities;
+    CameraWidget *widget;
+    const char *serial;
+    const char *home = getenv("HOME");
+    if (!home || gp_camera_get_abilities(camera, &abilities) != GP_OK ||
+        gp_camera_get_single_config(camera, "serialnumber", &widget, gpContext) != GP_OK) {
+        return "";
+    }
+    std::string key;
+    if (gp_widget_get_value(widget, &serial) == GP_OK && serial && *serial) {
+        key = std::string(abilities.model) + "_" + serial;
+    }
+    gp_widget_free(widget);
+    if (key.empty()) {
+        return "";
+    }
+
+    for (char &c : key) {
+        if (!isalnum((unsigned char)c) && c != '-') {
+            c = '_';
+        }
+    }
+
+    std::string dir = std::string(home) + "/.indi";
+    mkdir(dir.c_str(), 0755);
+    dir += "/lumix";
+    mkdir(dir.c_str(), 0755);
+    return dir + "/" + key + ".cache";
+}
+
+bool LumixCameraDriver::loadCapabilityCache(const std::string &path) {
+    // one entry per line, its fields separated by tabs
+    static const char *const infoKeys[] = {"manufacturer", "model", "serial", "version"};
+    std::ifstream file(path);
+    std::string line;
+    if (!std::getline(file, line) || line != CAPABILITY_CACHE_HEADER) {
+        return false;
+    }
+
+    std::map<float, std::string> shutterSpeeds;
+    std::map<int, std::string> isos;
+    std::string bulb;
+    std::string info[4];
+    int width = 0, height = 0;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        size_t start = 0, end;
+        while ((end = line.find('\t', start)) != std::string::npos) {
+            fields.push_back(line.substr(start, end - start));
+            start = end + 1;
+        }
+        fields.push_back(line.substr(start));
+
+        const std::string &key = fields[0];
+        if (key == "shutter" && fields.size() == 3) {
+            shutterSpeeds[strtof(fields[1].c_str(), nullptr)] = fields[2];
+        } else if (key == "iso" && fields.size() == 3) {
+            isos[atoi(fields[1].c_str())] = fields[2];
+        } else if (key == "bulb" && fields.size() == 2) {
+            bulb = fields[1];
+        } else if (key == "sensor" && fields.size() == 3) {
+            width = atoi(fields[1].c_str());
+            height = atoi(fields[2].c_str());
+        } else {
+            for (int i = MANUFACTURER; i <= VERSION; i++) {
+                if (key == infoKeys[i] && fields.size() == 2) {
+                    info[i] = fields[1];
+                }
+            }
+        }
+    }
+    if (shutterSpeeds.empty() || isos.empty()) {
+        LOGF_WARN("Ignoring the incomplete camera capability cache %s.", path.c_str());
+        return false;
+    }
+
+    ss_choices = std::move(shutterSpeeds);
+    bulbChoice = bulb;
+    for (int i = MANUFACTURER; i <= VERSION; i++) {
+        cameraInfo[i] = info[i].empty() ? "Unknown" : info[i];
+    }
+    {
+        std::lock_guard<std::mutex> lock(choicesMutex);
+        iso_choices = std::move(isos);
+    }
+    if (width > 0 && height > 0) {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        sensorWidth = width;
+        sensorHeight = height;
+    }
+
+    LOGF_INFO("Loaded the camera capabilities from %s", path.c_str());
+    return true;
+}
+
+void LumixCameraDriver::saveCapabilityCache() {
+    // only called while the camera is owned by the calling thread, which is the one changing the tables
+    static const char *const infoKeys[] = {"manufacturer", "model", "serial", "version"};
+    if (capabilityCache.empty()) {
+        return;
+    }
+
+    std::ostringstream out;
+    out << CAPABILITY_CACHE_HEADER << '\n';
+    for (int i = MANUFACTURER; i <= VERSION; i++) {
+        out << infoKeys[i] << '\t' << cameraInfo[i] << '\n';
+    }
+    if (!bulbChoice.empty()) {
+        out << "bulb\t" << bulbChoice << '\n';
+    }
+    // enough digits for the durations to read back as the same floats
+    out << std::setprecision(9);
+    for (auto &choice : ss_choices) {
+        out << "shutter\t" << choice.first << '\t' << choice.second << '\n';
+    }
+    {
+        std::lock_guard<std::mutex> lock(choicesMutex);
+        for (auto &choice : iso_choices) {
+            out << "iso\t" << choice.first << '\t' << choice.second << '\n';
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (sensorWidth > 0 && sensorHeight > 0) {
+            out << "sensor\t" << sensorWidth << '\t' << sensorHeight << '\n';
+        }
+    }
+
+    // written next to it and moved over, so a crash never leaves half a file
+    std::string temp = capabilityCache + ".tmp";
+    std::ofstream file(temp);
+    file << out.str();
+    file.close();
+    if (!file || rename(temp.c_str(), capabilityCache.c_str()) != 0) {
+        LOGF_WARN("Could not write the camera capability cache %s.", capabilityCache.c_str());
+        return;
+    }
+    LOGF_DEBUG("Saved the camera capabilities to %s", capabilityCache.c_str());
+}
+
+void LumixCameraDriver::revalidateCapabilities() {
+    // runs on the capture thread after connecting from the cache, in case a firmware update changed the camera
+    CameraWidget *tree, *widget;
+    int ret = gp_camera_get_config(camera, &tree, gpContext);
+    if (ret != GP_OK) {
+        LOGF_WARN("Could not check the cached camera capabilities: %s", gp_result_as_string(ret));
+        return;
+    }
+
+    std::map<float, std::string> shutterSpeeds;
+    std::map<int, std::string> isos;
+    std::string info[4];
+    if (gp_widget_get_child_by_name(tree, "shutterspeed", &widget) == GP_OK) {
+        readShutterChoices(widget, shutterSpeeds);
+    }
+    if (gp_widget_get_child_by_name(tree, "iso", &widget) == GP_OK) {
+        readIsoChoices(widget, isos);
+    }
+    readCameraInfo(tree, info);
+    gp_widget_free(tree);
+
+    if (shutterSpeeds.empty() || isos.empty()) {
+        LOG_WARN("Could not check the cached camera capabilities.");
+        return;
+    }
+
+    bool changed = shutterSpeeds != ss_choices || !std::equal(info, info + 4, cameraInfo);
+    {
+        std::lock_guard<std::mutex> lock(choicesMutex);
+        changed = changed || isos != iso_choices;
+        if (!changed) {
+            LOG_DEBUG("The cached camera capabilities are up to date.");
+            return;
+        }
+        iso_choices = std::move(isos);
+    }
+
+    // the new choices are used right away, the camera info shows up with the next connect
+    LOG_INFO("The camera capabilities changed since they were cached, updating the cache.");
+    ss_choices = std::move(shutterSpeeds);
+    std::copy(info, info + 4, cameraInfo);
+    saveCapabilityCache();
+}
+
+void LumixCameraDriver::noteSensorSize(int width, int height) {
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    if (width == sensorWidth && height == sensorHeight) {
+        return;
+    }
+
+    sensorWidth = width;
+    sensorHeight = height;
+    sensorChanged = true;
+    queueCameraCommand(COMMAND_INFO, "save capabilities", [this] {
+        saveCapabilityCache();
+    });
+}
+
+void LumixCameraDriver::updateSensorGeometry() {
+    // the frame geometry is changed between exposures, it resets the client's subframe
+    if (InExposure) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (!sensorChanged) {
+            return;
+        }
+        sensorChanged = false;
+        LOGF_INFO("The sensor is %ix%i, updating the frame size.", sensorWidth, sensorHeight);
+    }
+
+    setupParams();
+}
+
+bool LumixCameraDriver::load_camera_info() {
+    for (int i = MANUFACTURER; i <= VERSION; i++) {
+        CameraInfoTP[i].setText(cameraInfo[i].c_str());
+    }
+
+    defineProperty(CameraInfoTP);
+
+    // Load the ISO param
     const char *value;
-    ret = gp_widget_get_value(ss, &value);
+    int ret = gp_widget_get_value(iso_w, &value);
+    if (ret == GP_OK) {
+        IsoNP[0].fill(
+            "ISO",
+            "ISO",
+            "%i",
+            iso_choices.begin()->first,
+            std::prev(iso_choices.end())->first,
+            1,
+            std::stoi(value)
+        );
+    } else {
+        LOG_ERROR("Failed to get camera iso.");
+    }
+
+    defineProperty(IsoNP);
+
+    return true;
+}
+
+bool LumixCameraDriver::Connect()
+{
+    // Connect to the camera, on the port from the last connect (or the one the user set) when there is one
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        cameraPort = CameraPortTP[PORT].getText();
+        cameraModel = CameraPortTP[PORT_MODEL].getText();
+    }
+    try {
+        if (!connect_to_lumix_camera()) {
+            LOG_ERROR("No Lumix camera found. Ensure it's connected and powered on.");
+            return false;
+        } else {
+            setupParams();
+            startPipeline();
+
+            // a camera connected from the cache gets its full configuration checked once it is idle
+            if (capabilitiesCached) {
+                std::lock_guard<std::mutex> lock(pipelineMutex);
+                queueCameraCommand(COMMAND_INFO, "revalidate capabilities", [this] {
+                    revalidateCapabilities();
+                });
+            }
+        }
+    } catch (const std::exception& e) {
+        LOG_ERROR("Error connecting to camera");
+
+        return false;
+    }
+
+    LOG_INFO("Connected to camera");
+
+    return true;
+}
+
+bool LumixCameraDriver::Disconnect()
+{
+    // stop the capture pipeline before the camera goes away
+    stopPipeline();
+    planTotal = planDone;
+
+    // Disconnect from the camera (unless a reconnect was still trying to get it back)
+    if (camera) {
+        gp_camera_exit(camera, gpContext);
+        gp_camera_free(camera);
+        gp_context_unref(gpContext);
+        camera = nullptr;
+    }
+    freeCameraWidgets();
+
+    LOG_INFO("Disconnected from camera");
+
+    return true;
+}
+
+bool LumixCameraDriver::getExposureValue(float duration, std::string &value) {
+    if (ss_choices.empty()) {
+        LOG_ERROR("There are no possible shutter speeds. Try reconnecting your camera.");
+        return false;
+    }
+
+        // Check if the target is out of bounds
+    if (duration < ss_choices.begin()->first || duration > std::prev(ss_choices.end())->first) {
+        LOG_ERROR("The set exposure time is outside the capabilities of your camera.");
+        return false;
+    }
+
+    // Use lower_bound to find the first element not less than target
+    auto lower = ss_choices.lower_bound(duration);
+
+    // If lower is the beginning, return its value
+    if (lower == ss_choices.begin()) {
+        value = lower->second;
+        return true;
+    }
+    // If lower is the end, return the previous element's value
+    if (lower == ss_choices.end()) {
+        value = std::prev(lower)->second;
+        return true;
+    }
+
+    // Compare the element before `lower` with `lower` to find the closest
+    auto prev = std::prev(lower);
+    if (std::abs(duration - prev->first) <= std::abs(duration - lower->first)) {
+        value = prev->second;
+        return true;
+    } else {
+        value = lower->second;
+        return true;
+    }
+}
+
+bool LumixCameraDriver::getIsoChoiceValue(int iso, std::string &value) {
+    std::lock_guard<std::mutex> lock(choicesMutex);
+    if (iso_choices.empty()) {
+        LOG_ERROR("There are no possible iso values. Try reconnecting your camera.");
+        return false;
+    }
+
+    // Check if the target is out of bounds
+    if (iso < iso_choices.begin()->first || iso > std::prev(iso_choices.end())->first) {
+        LOG_ERROR("The set iso value is outside the capabilities of your camera.");
+        return false;
+    }
+
+    // Use lower_bound to find the first element not less than target
+    auto lower = iso_choices.lower_bound(iso);
+
+    // If lower is the beginning, return its value
+    if (lower == iso_choices.begin()) {
+        value = lower->second;
+        return true;
+    }
+    // If lower is the end, return the previous element's value
+    if (lower == iso_choices.end()) {
+        value = std::prev(lower)->second;
+        return true;
+    }
+
+    // Compare the element before `lower` with `lower` to find the closest
+    auto prev = std::prev(lower);
+    if (std::abs(iso - prev->first) <= std::abs(iso - lower->first)) {
+        value = prev->second;
+        return true;
+    } else {
+        value = lower->second;
+        return true;
+    }
+}
+
+bool LumixCameraDriver::setupParams()
+{
+    float x_pixel_size, y_pixel_size;
+    int bit_depth = 16; // valid values are 8, 16, 32
+    int x_1, y_1, x_2, y_2;
+    int channels = getOutputChannels();
+
+    // TODO: Actually get the pixel size from the camera
+    x_pixel_size = 5.95;
+    y_pixel_size = 5.95;
+
+    // the image size comes from the first decoded frame (or the capability cache), a 6008x4008 sensor is assumed until then
+    x_1 = y_1 = 0;
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        x_2 = sensorWidth > 0 ? sensorWidth : DEFAULT_SENSOR_WIDTH;
+        y_2 = sensorHeight > 0 ? sensorHeight : DEFAULT_SENSOR_HEIGHT;
+    }
+
+    // Set the pixel size
+    SetCCDParams(x_2 - x_1, y_2 - y_1, bit_depth, x_pixel_size, y_pixel_size);
+
+    // Set the channels (a single channel mosaic is a 2 axis image)
+    PrimaryCCD.setNAxis(channels == 1 ? 2 : 3);
+
+    // TODO: Now we usually do the following in the hardware
+    // Set Frame to LIGHT or NORMAL
+    // Set Binning to 1x1
+    /* Default frame type is NORMAL */
+
+    // Calculate the required buffer
+    int scale = getOutputScale();
+    int nbuf;
+    nbuf = (PrimaryCCD.getXRes() / scale) * (PrimaryCCD.getYRes() / scale) * ((PrimaryCCD.getBPP() * channels) / 8); // this is the pixel count
+    nbuf += 512; // add some extra buffer
+    PrimaryCCD.setFrameBufferSize(nbuf);
+
+    return true;
+}
+
+bool LumixCameraDriver::isSuperpixelBinning()
+{
+    return BinModeSP.findOnSwitchIndex() == BIN_SUPERPIXEL && PrimaryCCD.getBinX() % 2 == 0 && PrimaryCCD.getBinY() % 2 == 0;
+}
+
+int LumixCameraDriver::getOutputChannels()
+{
+    // superpixels turn the mosaic into RGB even in raw mode
+    if (isSuperpixelBinning() || FrameQualitySP.findOnSwitchIndex() == QUALITY_HALF_SIZE) {
+        return 3;
+    }
+
+    return RawBayerSP.findOnSwitchIndex() == RAW_BAYER ? 1 : 3;
+}
+
+int LumixCameraDriver::getOutputScale()
+{
+    // half size frames have one pixel per 2x2 CFA cell, on top of the client's binning. It stays out of the
+    // chip's binning, the frame carries it and the chip describes the frame that way when it is delivered
+    return FrameQualitySP.findOnSwitchIndex() == QUALITY_HALF_SIZE ? 2 : 1;
+}
+
+bool LumixCameraDriver::setConfigValue(CameraWidget *widget, const char *value)
+{
+    const char *name;
+    if (gp_widget_get_name(widget, &name) != GP_OK) {
+        LOG_ERROR("Failed to get the name of a camera setting.");
+        return false;
+    }
+
+    // nothing to send if this is what the camera has, or is already going to get
+    auto pending = pendingConfig.find(name);
+    if (pending != pendingConfig.end() ? pending->second.value == value : cameraConfig[name] == value) {
+        return true;
+    }
+
+    LOGF_INFO("Setting %s to %s", name, value);
+    int ret = gp_widget_set_value(widget, value);
     if (ret != GP_OK) {
-        LOG_ERROR("Could not get current camera shutter speed setting.");
+        LOGF_ERROR("Failed to set %s to %s.", name, value);
+        return false;
+    }
+
+    if (cameraConfig[name] == value) {
+        // changed back before it was sent
+        pendingConfig.erase(name);
+    } else {
+        pendingConfig[name] = {widget, value};
+    }
+
+    return true;
+}
+
+bool LumixCameraDriver::applyConfig()
+{
+    if (pendingConfig.empty()) {
+        return true;
+    }
+
+    int ret = GP_OK;
+    if (pendingConfig.size() == 1 || !config) {
+        // a single change only needs a round trip for its own setting, and widgets that were read
+        // on their own (from a cached camera) have no tree to send together
+        for (auto &change : pendingConfig) {
+            ret = gp_camera_set_single_config(camera, change.first.c_str(), change.second.widget, gpContext);
+            if (ret != GP_OK) {
+                break;
+            }
+        }
+    } else {
+        // several changes go out in one transaction, gphoto only sends the widgets that were changed
+        ret = gp_camera_set_config(camera, config, gpContext);
+    }
+    if (ret != GP_OK) {
+        // they stay pending, so the next capture tries again
+        LOGF_ERROR("Failed to apply camera settings: %s", gp_result_as_string(ret));
+        return false;
+    }
+
+    for (auto &change : pendingConfig) {
+        LOGF_DEBUG("Applied %s = %s", change.first.c_str(), change.second.value.c_str());
+        cameraConfig[change.first] = change.second.value;
+    }
+    pendingConfig.clear();
+
+    return true;
+}
+
+bool LumixCameraDriver::setShutterSpeed(float duration) {
+    std::string value;
+    if (!getExposureValue(duration, value)) {
+        return false;
+    }
+
+    return setConfigValue(ss, value.c_str());
+}
+
+bool LumixCameraDriver::setIso(int iso) {
+    std::string value;
+    if (!getIsoChoiceValue(iso, value)) {
+        return false;
+    }
+
+    return setConfigValue(iso_w, value.c_str());
+}
+
+ExposureSettings LumixCameraDriver::currentExposureSettings(float duration)
+{
+    ExposureSettings settings;
+    settings.duration  = duration;
+    settings.iso       = IsoNP[0].getValue();
+    settings.frameType = PrimaryCCD.getFrameType();
+    settings.subX      = PrimaryCCD.getSubX();
+    settings.subY      = PrimaryCCD.getSubY();
+    settings.subW      = PrimaryCCD.getSubW();
+    settings.subH      = PrimaryCCD.getSubH();
+    settings.binX      = PrimaryCCD.getBinX();
+    settings.binY      = PrimaryCCD.getBinY();
+    settings.channels  = getOutputChannels();
+    settings.bpp       = PrimaryCCD.getBPP();
+    settings.rawBayer  = RawBayerSP.findOnSwitchIndex() == RAW_BAYER;
+    settings.binSum    = BinModeSP.findOnSwitchIndex() == BIN_SUM;
+    settings.superpixel = isSuperpixelBinning();
+    settings.quality    = FrameQualitySP.findOnSwitchIndex();
+    if (settings.quality == QUALITY_HALF_SIZE) {
+        // a half size frame is a superpixel collapse of the binned mosaic
+        settings.binX *= 2;
+        settings.binY *= 2;
+        settings.superpixel = true;
+    }
+    settings.rawFollowUp = settings.quality == QUALITY_QUICK_LOOK && RawFollowUpSP.findOnSwitchIndex() == RAW_FOLLOW_UP;
+    settings.whiteBalance = settings.quality == QUALITY_LINEAR && WhiteBalanceSP.findOnSwitchIndex() == WHITE_BALANCE_CAMERA;
+    settings.vng = settings.quality == QUALITY_LINEAR && LinearDemosaicSP.findOnSwitchIndex() == DEMOSAIC_VNG;
+    settings.native = EncodeFormatSP.findOnSwitchIndex() == FORMAT_NATIVE;
+    settings.compress = EncodeFormatSP.findOnSwitchIndex() == FORMAT_FITS && TileCompressSP.findOnSwitchIndex() == TILE_COMPRESS;
+
+    return settings;
+}
+
+bool LumixCameraDriver::StartExposure(float duration)
+{
+    if (planTotal > planDone) {
+        LOG_ERROR("An exposure plan is running, abort it first.");
+        return false;
+    }
+
+    // Set the exposure request
+    PrimaryCCD.setExposureDuration(duration);
+    ExposureRequest = duration;
+
+    ExposureSettings settings = currentExposureSettings(duration);
+    int burst = BurstNP[0].getValue();
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+
+        framesToCome = std::max(0, framesToCome - 1);
+
+        if (burst > 1) {
+            // the capture thread takes the frames after the first one on its own, the client gets all of them
+            dropSpeculation();
+
+            captureRequest = std::make_unique<LumixFrame>();
+            captureRequest->id = nextFrameId++;
+            captureRequest->settings = settings;
+            captureRequest->burst = true;
+            awaitedFrames.push_back(captureRequest->id);
+
+            burstFirstId = captureRequest->id;
+            burstNextId = nextFrameId;
+            burstLeft = burst - 1;
+            for (int i = 1; i < burst; i++) {
+                awaitedFrames.push_back(nextFrameId++);
+            }
+            exposureId = nextFrameId - 1;
+
+            burstCaptured = burstDownloaded = burstProcessed = 0;
+            burstChanged = true;
+            lastSettings = settings;
+
+            LOGF_INFO("Starting a burst of %i exposures.", burst);
+        } else if (speculativeId != 0 && speculativeSettings == settings) {
+            // the pipeline already started (or even finished) this exposure, so just wait on it
+            exposureId = speculativeId;
+            speculativeId = 0;
+
+            // the frame is the client's now, so its file is kept or deleted like any other
+            if (speculativePath.name[0] != '\0') {
+                if (!saveOnCamera) {
+                    CameraFilePath path = speculativePath;
+                    queueCameraCommand(COMMAND_INFO, "delete claimed file", [this, path] {
+                        queueDelete(path);
+                    });
+                }
+                speculativePath = {};
+            }
+
+            // and keep the pipeline going if the camera is already free
+            if (pipelineEnabled && framesToCome > 0 && lastCapturedId >= exposureId && !captureRequest) {
+                speculateNext = true;
+            }
+
+            LOG_INFO("Using pipelined exposure.");
+        } else {
+            // a frame exposed ahead of time with different settings is useless now
+            dropSpeculation();
+
+            captureRequest = std::make_unique<LumixFrame>();
+            captureRequest->id = nextFrameId++;
+            captureRequest->settings = settings;
+            exposureId = captureRequest->id;
+        }
+
+        if (burst <= 1) {
+            awaitedFrames.push_back(exposureId);
+            lastSettings = settings;
+        }
+    }
+    pipelineCondition.notify_all();
+
+    PipelineFramesNP[0].setValue(framesToCome);
+    PipelineFramesNP.apply();
+
+    InExposure = true;
+
+    return true;
+}
+
+bool LumixCameraDriver::startPlan(const std::string &text)
+{
+    if (InExposure || planTotal > planDone) {
+        LOG_ERROR("The camera is busy, the plan can start once the current exposure is done.");
         return false;
     }
-    if (strcmp(value, "bulb")) {
-        ret = gp_widget_set_value(ss, "1");
-        if (ret != GP_OK) {
-            LOG_ERROR("Please disable bulb mode or use a shutter speed other than bulb then reconnect the camera.");
-            return false;
+
+    std::vector<PlanEntry> entries;
+    std::string error;
+    if (!parsePlan(text, entries, error)) {
+        LOGF_ERROR("Could not read the exposure plan: %s.", error.c_str());
+        return false;
+    }
+
+    // grouping the entries by iso and then duration means the camera settings change as rarely as
+    // possible, entries with the same settings run as one
+    if (PlanOrderSP.findOnSwitchIndex() == PLAN_GROUP) {
+        std::stable_sort(entries.begin(), entries.end(), [](const PlanEntry &a, const PlanEntry &b) {
+            return a.iso != b.iso ? a.iso < b.iso : a.duration > b.duration;
+        });
+    }
+
+    ExposureSettings base = currentExposureSettings(0);
+    std::vector<ExposureSettings> frames;
+    double seconds = 0;
+    int changes = 0;
+    for (auto &entry : entries) {
+        ExposureSettings settings = base;
+        settings.duration = entry.duration;
+        settings.iso = entry.iso > 0 ? entry.iso : base.iso;
+        settings.frameType = entry.frameType;
+        if (!frames.empty() && (frames.back().duration != settings.duration || frames.back().iso != settings.iso)) {
+            changes++;
         }
+        frames.insert(frames.end(), entry.count, settings);
+        seconds += entry.count * entry.duration;
     }
 
-    // get number of ss widget choices
-    int count = gp_widget_count_choices(ss);
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
 
-    // go through all possible shutter speed values (skip first choice as it is usually bulb mode in a weird format)
-    for (int i = 1; i < count; i++) {
-        const char *choice;
-        ret = gp_widget_get_choice(ss, i, &choice);
-        if (ret != GP_OK) {
-            LOG_ERROR("Failed to get possible shutter speed value.");
+        // a frame exposed ahead of time isn't part of the plan
+        dropSpeculation();
+
+        planQueue.clear();
+        planFirstId = nextFrameId;
+        for (auto &settings : frames) {
+            planQueue.push_back({nextFrameId, settings});
+            awaitedFrames.push_back(nextFrameId++);
+        }
+        planQueuedSeconds = seconds;
+        exposureId = nextFrameId - 1;
+    }
+    pipelineCondition.notify_all();
+
+    planDone = 0;
+    planTotal = frames.size();
+    PlanProgressNP[PLAN_DONE].setValue(0);
+    PlanProgressNP[PLAN_TOTAL].setValue(planTotal);
+    PlanProgressNP.setState(IPS_BUSY);
+    PlanProgressNP.apply();
+
+    ExposureRequest = seconds;
+    PrimaryCCD.setExposureDuration(frames.front().duration);
+    InExposure = true;
+
+    LOGF_INFO("Running an exposure plan of %i frames (%.0f s of exposure, %i setting changes).", planTotal, seconds, changes);
+    return true;
+}
+
+bool LumixCameraDriver::AbortExposure()
+{
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        abortStarted = std::chrono::steady_clock::now();
+
+        // nothing in flight is wanted anymore
+        captureRequest.reset();
+        awaitedFrames.clear();
+        burstLeft = 0;
+        planQueue.clear();
+        planQueuedSeconds = 0;
+
+        // drop the work that hasn't started, frames still downloading are dropped once the capture thread lets go of them
+        processingQueue.erase(std::remove_if(processingQueue.begin(), processingQueue.end(),
+            [](const std::unique_ptr<LumixFrame> &frame) {
+                return !frame->downloading;
+            }), processingQueue.end());
+        completedFrames.clear();
+
+        // and stop the decoding that has
+        for (auto &decoder : decoding) {
+            decoder.first->set_cancel_flag();
+        }
+
+        // the capture thread finishes the abort once gphoto gave up on the exposure or download
+        if (capturingId != 0 || std::any_of(processingQueue.begin(), processingQueue.end(),
+            [](const std::unique_ptr<LumixFrame> &frame) {
+                return frame->downloading;
+            })) {
+            aborting = true;
+            cancelIo = true;
+            queueCameraCommand(COMMAND_ABORT, "abort", [this] {
+                finishAbort();
+            });
+        }
+        // after the abort is set up, so a frame exposed ahead is cancelled with it and only its file is left
+        dropSpeculation();
+        if (!aborting) {
+            LOGF_INFO("Exposure aborted in %.1f ms", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - abortStarted).count());
+        }
+    }
+    pipelineCondition.notify_all();
+
+    InExposure = false;
+
+    if (planTotal > planDone) {
+        LOGF_INFO("Exposure plan aborted after %i of %i frames.", planDone, planTotal);
+        planTotal = planDone;
+        PlanProgressNP.setState(IPS_ALERT);
+        PlanProgressNP.apply();
+        PlanSP.setState(IPS_IDLE);
+        PlanSP.apply();
+    }
+
+    return true;
+}
+
+void LumixCameraDriver::dropSpeculation()
+{
+    // called with the pipeline mutex held
+    speculateNext = false;
+    if (speculativeId == 0) {
+        return;
+    }
+
+    // an exposure nobody asked for doesn't get to hold up the camera, the capture thread deletes its file
+    if (capturingId == speculativeId && !aborting) {
+        abortStarted = std::chrono::steady_clock::now();
+        aborting = true;
+        cancelIo = true;
+        queueCameraCommand(COMMAND_ABORT, "drop pipelined exposure", [this] {
+            finishAbort();
+        });
+    }
+    if (speculativePath.name[0] != '\0') {
+        CameraFilePath path = speculativePath;
+        queueCameraCommand(COMMAND_INFO, "delete pipelined file", [this, path] {
+            queueDelete(path);
+        });
+        speculativePath = {};
+    }
+    speculativeId = 0;
+}
+
+void LumixCameraDriver::finishAbort()
+{
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    if (!aborting) {
+        return;
+    }
+
+    aborting = false;
+    cancelIo = false;
+    LOGF_INFO("Exposure aborted in %.1f ms, the camera is ready again", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - abortStarted).count());
+}
+
+void LumixCameraDriver::startPipeline()
+{
+    stopPipeline();
+
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        pipelineRunning = true;
+        captureRequest.reset();
+        awaitedFrames.clear();
+        processingQueue.clear();
+        completedFrames.clear();
+        capturingId = 0;
+        lastCapturedId = nextFrameId - 1;
+        speculativeId = 0;
+        speculateNext = false;
+        speculativePath = {};
+        burstLeft = 0;
+        planQueue.clear();
+        streaming = false;
+        cameraCommands.clear();
+        aborting = false;
+        cancelIo = false;
+        cameraOperation = nullptr;
+        stalled = false;
+    }
+    abortedCaptures = 0;
+    abortedSpeculations = 0;
+
+    captureThread = std::thread(&LumixCameraDriver::captureLoop, this);
+    for (size_t i = 0; i < processingThreadCount; i++) {
+        processingThreads.emplace_back(&LumixCameraDriver::processingLoop, this, i);
+    }
+}
+
+void LumixCameraDriver::stopPipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        pipelineRunning = false;
+    }
+    pipelineCondition.notify_all();
+
+    // this waits for a capture that is still in progress on the camera
+    if (captureThread.joinable()) {
+        captureThread.join();
+    }
+    for (std::thread &thread : processingThreads) {
+        thread.join();
+    }
+    processingThreads.clear();
+
+    // don't hold on to full frames while disconnected
+    spareBuffers.clear();
+    spareFiles.clear();
+    rawFollowUps.clear();
+    cameraShots.clear();
+    if (previewFile) {
+        gp_file_free(previewFile);
+        previewFile = nullptr;
+    }
+}
+
+void LumixCameraDriver::setProcessingThreads(size_t count)
+{
+    count = std::max<size_t>(1, count);
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        processingThreadCount = count;
+
+        // the pool is started on connect
+        if (!pipelineRunning) {
+            return;
+        }
+    }
+    pipelineCondition.notify_all();
+
+    // workers past the new count exit once they finish their current frame
+    while (processingThreads.size() > count) {
+        processingThreads.back().join();
+        processingThreads.pop_back();
+    }
+    while (processingThreads.size() < count) {
+        processingThreads.emplace_back(&LumixCameraDriver::processingLoop, this, processingThreads.size());
+    }
+}
+
+bool LumixCameraDriver::isAwaited(uint64_t id) const
+{
+    return std::find(awaitedFrames.begin(), awaitedFrames.end(), id) != awaitedFrames.end();
+}
+
+void LumixCameraDriver::captureLoop()
+{
+    while (true) {
+        std::unique_ptr<LumixFrame> frame;
+        {
+            std::unique_lock<std::mutex> lock(pipelineMutex);
+            // live view wakes the thread up when the next preview is due
+            auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(CAMERA_IDLE_POLL_MS);
+            if (streaming) {
+                until = std::min(until, nextPreview);
+            }
+            bool woken = pipelineCondition.wait_until(lock, until, [this] {
+                return !pipelineRunning || captureRequest || burstLeft > 0 || !planQueue.empty() || speculateNext ||
+                       !cameraCommands.empty() || stalled;
+            });
+            if (!pipelineRunning) {
+                return;
+            }
+
+            // aborts go first, then captures, then everything else
+            if (runCameraCommand(lock, COMMAND_ABORT)) {
+                continue;
+            }
+            if (stalled) {
+                lock.unlock();
+                recoverFromStall();
+                continue;
+            }
+            if (!captureRequest && burstLeft == 0 && planQueue.empty() && !speculateNext) {
+                if (!burstDownloads.empty()) {
+                    // a burst that was cut short still has frames on the card
+                    lock.unlock();
+                    if (!downloadBurst()) {
+                        return;
+                    }
+                    continue;
+                }
+                if (woken) {
+                    runCameraCommand(lock, COMMAND_INFO);
+                    continue;
+                }
+                if (streaming) {
+                    if (std::chrono::steady_clock::now() >= nextPreview) {
+                        lock.unlock();
+                        capturePreview();
+                    }
+                    continue;
+                }
+
+                // keep listening to the camera while idle, so shots taken with its own shutter button show up too
+                bool picked = pollCameraFiles(lock);
+                if (!picked && pipelineRunning && !pendingDeletes.empty()) {
+                    // idle time goes to cleaning up the card, a few files at a time so captures don't wait long
+                    lock.unlock();
+                    watchOperation("delete", COMMAND_DEADLINE);
+                    deletePendingFiles(std::chrono::steady_clock::time_point::max(), DELETE_BATCH);
+                    watchOperation(nullptr);
+                }
+                continue;
+            } else if (captureRequest) {
+                frame = std::move(captureRequest);
+            } else if (burstLeft > 0) {
+                // the next frame of a burst goes right after the last one
+                frame = std::make_unique<LumixFrame>();
+                frame->id = burstNextId++;
+                frame->settings = lastSettings;
+                frame->burst = true;
+                burstLeft--;
+            } else if (!planQueue.empty()) {
+                frame = std::make_unique<LumixFrame>();
+                frame->id = planQueue.front().first;
+                frame->settings = planQueue.front().second;
+                frame->planned = true;
+                planQueue.pop_front();
+                planQueuedSeconds -= frame->settings.duration;
+                lastSettings = frame->settings;
+            } else {
+                // expose the next frame ahead of the client, so it is ready by the time it gets asked for
+                frame = std::make_unique<LumixFrame>();
+                frame->id = nextFrameId++;
+                frame->settings = lastSettings;
+                frame->speculative = true;
+                speculativeId = frame->id;
+                speculativeSettings = frame->settings;
+            }
+            speculateNext = false;
+            capturingId = frame->id;
+            capturingStarted = std::chrono::steady_clock::now();
+        }
+
+        // the camera is only used from this thread, so downloading here keeps it serialized with the captures
+        watchOperation("capture", frame->settings.duration + CAPTURE_DEADLINE);
+        bool captured = captureImage(*frame);
+
+        // a stalled camera is reconnected and the frame taken again
+        for (int retry = 0; !captured && retry < MAX_FRAME_RETRIES && recoverFromStall(); retry++) {
+            LOGF_INFO("Retrying the exposure (attempt %i).", retry + 2);
+            {
+                std::lock_guard<std::mutex> lock(pipelineMutex);
+                capturingStarted = std::chrono::steady_clock::now();
+            }
+            watchOperation("capture", frame->settings.duration + CAPTURE_DEADLINE);
+            captured = captureImage(*frame);
+        }
+        watchOperation(nullptr);
+        if (cancelIo) {
+            captured = false;
+
+            // what a dropped frame exposed ahead leaves on the card goes, whether photos are kept or not
+            if (frame->speculative) {
+                if (frame->path.name[0] != '\0') {
+                    queueDelete(frame->path);
+                } else {
+                    abortedSpeculations++;
+                }
+            }
+        }
+
+        // burst frames stay on the card while the burst goes on, only their paths are kept
+        if (frame->burst && captured) {
+            bool more;
+            {
+                std::lock_guard<std::mutex> lock(pipelineMutex);
+                capturingId = 0;
+                lastCapturedId = std::max(lastCapturedId, frame->id);
+                burstCaptured++;
+                burstChanged = true;
+                more = burstLeft > 0 && pipelineRunning;
+            }
+            if (more) {
+                burstDownloads.push_back(std::move(frame));
+                continue;
+            }
+        }
+
+        // once the burst is over (or failed) what it left on the card is downloaded in order
+        if (!downloadBurst() || !passOnFrame(std::move(frame), captured)) {
+            return;
+        }
+    }
+}
+
+bool LumixCameraDriver::downloadBurst()
+{
+    while (!burstDownloads.empty()) {
+        std::unique_ptr<LumixFrame> queued = std::move(burstDownloads.front());
+        burstDownloads.pop_front();
+
+        bool wanted;
+        {
+            std::lock_guard<std::mutex> lock(pipelineMutex);
+            wanted = isAwaited(queued->id);
+        }
+        if (!wanted) {
+            // the burst was aborted
+            if (!saveOnCamera) {
+                queueDelete(queued->path);
+            }
             continue;
         }
-        std::string choice_string = std::string(choice);
-        float choice_float = 0;
-        if (choice_string.rfind("1/", 0) == 0) {
-            choice_float = 1.0 / std::stof(choice_string.substr(2));
-        } else {
-            choice_float = std::stof(choice_string);
+        if (!passOnFrame(std::move(queued), true)) {
+            return false;
         }
-        ss_choices.insert({choice_float, choice});
-        LOGF_INFO("Possible Shutter Speed Value for choice %i: %f (%s)", i, choice_float, choice);
     }
-#pragma endregion ShutterSpeedSetup
 
-#pragma region ISOSetup
-    // get iso widget
-    ret = gp_widget_get_child_by_name(config, "iso", &iso_w);
-    if (ret != GP_OK) {
-        LOG_ERROR("Could not get camera iso widget.");
+    return true;
+}
+
+void LumixCameraDriver::queueCameraCommand(CommandPriority priority, const char *name, std::function<void()> run)
+{
+    // called with the pipeline mutex held
+    cameraCommands.insert({priority, {name, std::move(run), std::chrono::steady_clock::now()}});
+    commandStatsChanged = true;
+    pipelineCondition.notify_all();
+}
+
+bool LumixCameraDriver::runCameraCommand(std::unique_lock<std::mutex> &lock, CommandPriority lowest)
+{
+    // commands of the same priority run in the order they were queued
+    auto next = cameraCommands.begin();
+    if (next == cameraCommands.end() || next->first > lowest) {
         return false;
     }
 
-    // ensure iso widget is a RADIO widget
-    ret = gp_widget_get_type(iso_w, &type);
-    if (ret != GP_OK || type != GP_WIDGET_RADIO) {
-        LOGF_ERROR("Iso widget is not a RADIO widget, rather it has the value %i.", type);
+    CameraCommand command = std::move(next->second);
+    cameraCommands.erase(next);
+
+    auto started = std::chrono::steady_clock::now();
+    lock.unlock();
+    watchOperation(command.name, COMMAND_DEADLINE);
+    command.run();
+    watchOperation(nullptr);
+    auto finished = std::chrono::steady_clock::now();
+    lock.lock();
+
+    commandWait = std::chrono::duration<double, std::milli>(started - command.queued).count();
+    commandTime = std::chrono::duration<double, std::milli>(finished - started).count();
+    commandStatsChanged = true;
+    LOGF_DEBUG("Camera command %s waited %.1f ms and took %.1f ms, %i still queued", command.name, commandWait, commandTime,
+               (int)cameraCommands.size());
+
+    return true;
+}
+
+bool LumixCameraDriver::pollCameraFiles(std::unique_lock<std::mutex> &lock)
+{
+    lock.unlock();
+    CameraFilePath path;
+    watchOperation("event check", COMMAND_DEADLINE);
+    bool added = nextFileAdded(&path, 0) > 0 && isRawFile(path.name);
+    watchOperation(nullptr);
+    lock.lock();
+
+    if (!added) {
         return false;
     }
 
-    // get number of iso widget choices
-    count = gp_widget_count_choices(iso_w);
+    if (abortedCaptures > 0) {
+        // nobody wants the file of an aborted exposure
+        abortedCaptures--;
+        bool speculative = abortedSpeculations > 0;
+        if (speculative) {
+            abortedSpeculations--;
+        }
+        lock.unlock();
+        LOGF_INFO("Discarding %s/%s from an aborted exposure.", path.folder, path.name);
+        if (!saveOnCamera || speculative) {
+            queueDelete(path);
+        }
+        lock.lock();
+        return true;
+    }
+
+    // nobody asked for the shot, so it never takes the place of an exposure the client is waiting on
+    lock.unlock();
+    if (sendCameraShots) {
+        LOGF_INFO("Picked up %s/%s taken on the camera.", path.folder, path.name);
+        LumixFrame shot;
+        shot.path = path;
+        watchOperation("download", DOWNLOAD_DEADLINE);
+        bool downloaded = streamFile(shot) >= GP_OK;
+        watchOperation(nullptr);
+        if (downloaded) {
+            lock.lock();
+            cameraShots.push_back({path.name, std::move(shot.fileData)});
+            lock.unlock();
+        } else {
+            LOGF_ERROR("Failed to download %s/%s from the camera.", path.folder, path.name);
+        }
+    } else {
+        LOGF_INFO("Ignoring %s/%s taken on the camera.", path.folder, path.name);
+    }
+    if (!saveOnCamera) {
+        queueDelete(path);
+    }
+    lock.lock();
+
+    return true;
+}
+
+void LumixCameraDriver::updateCameraQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (!commandStatsChanged) {
+            return;
+        }
+        commandStatsChanged = false;
+
+        CameraQueueNP[QUEUE_DEPTH].setValue(cameraCommands.size());
+        CameraQueueNP[COMMAND_WAIT].setValue(commandWait);
+        CameraQueueNP[COMMAND_TIME].setValue(commandTime);
+    }
+
+    CameraQueueNP.setState(IPS_OK);
+    CameraQueueNP.apply();
+}
+
+void LumixCameraDriver::watchOperation(const char *name, double seconds)
+{
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    cameraOperation = name;
+    operationDeadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>(seconds));
+}
+
+void LumixCameraDriver::reportStall(const char *reason)
+{
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    if (stalled) {
+        return;
+    }
+
+    LOGF_WARN("The camera %s, reconnecting it.", reason);
+    stalled = true;
+    stallCount++;
+    healthChanged = true;
+}
+
+void LumixCameraDriver::checkWatchdog()
+{
+    bool stalledNow = false;
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (cameraOperation && !stalled && std::chrono::steady_clock::now() > operationDeadline) {
+            LOGF_WARN("The camera did not finish the %s in time, reconnecting it.", cameraOperation);
+            stalled = true;
+            stallCount++;
+            healthChanged = true;
+
+            // get gphoto to give up on it
+            cancelIo = true;
+            stalledNow = true;
+        }
+    }
+    // and wake the capture thread if it is waiting on the pipeline rather than on gphoto
+    if (stalledNow) {
+        pipelineCondition.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (!healthChanged) {
+            return;
+        }
+        healthChanged = false;
+
+        CameraHealthNP[STALL_COUNT].setValue(stallCount);
+        CameraHealthNP[RECONNECT_COUNT].setValue(reconnectCount);
+        CameraHealthNP[RECONNECT_TIME].setValue(reconnectTime);
+        CameraHealthNP.setState(stalled ? IPS_BUSY : IPS_OK);
+    }
+
+    CameraHealthNP.apply();
+}
+
+bool LumixCameraDriver::recoverFromStall()
+{
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (!stalled) {
+            return false;
+        }
+        // an abort still needs its cancel until the capture thread finishes it
+        if (!aborting) {
+            cancelIo = false;
+        }
+    }
+
+    bool reconnected = reconnectCamera();
+
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    stalled = false;
+    healthChanged = true;
+
+    // frames aren't retried for a client that gave up on them
+    return reconnected && !aborting;
+}
+
+bool LumixCameraDriver::reconnectCamera()
+{
+    auto started = std::chrono::steady_clock::now();
+
+    gp_camera_exit(camera, gpContext);
+    gp_camera_free(camera);
+    gp_context_unref(gpContext);
+
+    while (!open_camera()) {
+        std::unique_lock<std::mutex> lock(pipelineMutex);
+        if (pipelineCondition.wait_for(lock, std::chrono::milliseconds(RECONNECT_RETRY_MS), [this] {
+            return !pipelineRunning;
+        })) {
+            return false;
+        }
+    }
+
+    // the camera may have come back with other settings, captures stage their own but an idle camera
+    // should look like it did before
+    ExposureSettings settings;
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        settings = lastSettings;
+    }
+    if (settings.iso > 0 && stageExposureSettings(settings)) {
+        applyConfig();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    LOGF_INFO("Reconnected to the camera in %.2f s, photos are %s on the camera.", seconds, saveOnCamera ? "kept" : "not kept");
+
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    reconnectCount++;
+    reconnectTime = seconds;
+    healthChanged = true;
+
+    return true;
+}
+
+bool LumixCameraDriver::passOnFrame(std::unique_ptr<LumixFrame> frame, bool captured)
+{
+    LumixFrame *download = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(pipelineMutex);
+        if (capturingId == frame->id) {
+            capturingId = 0;
+        }
+        lastCapturedId = std::max(lastCapturedId, frame->id);
+
+        // wait for room in the bounded queue to the processing stage
+        pipelineCondition.wait(lock, [this] {
+            return !pipelineRunning || processingQueue.size() < MAX_QUEUED_FRAMES;
+        });
+        if (!pipelineRunning) {
+            return false;
+        }
+
+        if (captured) {
+            // the frame is handed on before it is downloaded, so decoding can start while it streams in
+            frame->downloading = true;
+            if (!spareFiles.empty()) {
+                frame->fileData = std::move(spareFiles.back());
+                spareFiles.pop_back();
+            }
+            download = frame.get();
+        } else {
+            frame->failed = true;
+            if (frame->id == speculativeId) {
+                speculativeId = 0;
+            }
+        }
+
+        processingQueue.push_back(std::move(frame));
+    }
+    pipelineCondition.notify_all();
+
+    if (!download) {
+        return true;
+    }
+
+    // the camera settles on the next frame's settings while this one downloads
+    prefetchSettings();
+
+    // the processing threads keep the frame until the download is over
+    watchOperation("download", DOWNLOAD_DEADLINE);
+    bool downloaded = downloadImage(*download) == 0;
+    for (int retry = 0; !downloaded && retry < MAX_FRAME_RETRIES && recoverFromStall(); retry++) {
+        LOGF_INFO("Retrying the download (attempt %i).", retry + 2);
+        watchOperation("download", DOWNLOAD_DEADLINE);
+        downloaded = downloadImage(*download) == 0;
+    }
+    watchOperation(nullptr);
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        download->downloading = false;
+
+        if (!downloaded) {
+            download->failed = true;
+            if (download->id == speculativeId) {
+                speculativeId = 0;
+            }
+        } else if (download->burst) {
+            burstDownloaded++;
+            burstChanged = true;
+        } else if (download->planned) {
+            // the plan decides what comes next
+        } else if (pipelineEnabled && framesToCome > 0 && !captureRequest && isAwaited(download->id)) {
+            speculateNext = true;
+        }
+    }
+    pipelineCondition.notify_all();
+
+    return true;
+}
+
+bool LumixCameraDriver::StartStreaming()
+{
+    // live view frames are JPEGs, they go to the client as the camera sends them
+    Streamer->setPixelFormat(INDI_JPG);
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        streaming = true;
+        nextPreview = std::chrono::steady_clock::now();
+        previewFrames = 0;
+        previewDropped = 0;
+    }
+    pipelineCondition.notify_all();
+
+    LOG_INFO("Live view started.");
+    return true;
+}
 
-    // go through all possible iso values
-    for (int i = 0; i < count; i++) {
-        const char *choice;
-        ret = gp_widget_get_choice(iso_w, i, &choice);
-        if (ret != GP_OK) {
-            LOG_ERROR("Failed to get possible iso value.");
-            continue;
-        }
-        std::string choice_string = std::string(choice);
-        int choice_int = std::stoi(choice_string);
-        iso_choices.insert({choice_int, choice});
-        LOGF_INFO("Possible iso Value for choice %i: %i", i, choice_int);
-    }
-#pragma endregion ISOSetup
+bool LumixCameraDriver::StopStreaming()
+{
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    streaming = false;
 
+    LOGF_INFO("Live view stopped after %llu frames, %llu dropped for a busy client.", (unsigned long long)previewFrames,
+              (unsigned long long)previewDropped);
     return true;
 }
 
-bool LumixCameraDriver::load_camera_info() {
-    int ret;
-    const char *value;
-    CameraWidget *child;
+void LumixCameraDriver::capturePreview()
+{
+    auto started = std::chrono::steady_clock::now();
+    double fps = std::max(0.1, Streamer->getTargetFPS());
 
-    // Get the manufacturer field
-    ret = gp_widget_get_child_by_name(config, "manufacturer", &child);
-    if (ret == GP_OK) {
-        ret = gp_widget_get_value(child, &value);
-        if (ret == GP_OK) {
-            CameraInfoTP[MANUFACTURER].setText(value);
-        } else {
-            LOG_ERROR("Failed to get manufacturer name.");
-        }
-    } else {
-        LOG_ERROR("Manufacturer field not found.");
+    if (!previewFile) {
+        gp_file_new(&previewFile);
     }
+    watchOperation("preview", COMMAND_DEADLINE);
+    int ret = gp_camera_capture_preview(camera, previewFile, gpContext);
+    watchOperation(nullptr);
 
-    // Get the model field
-    ret = gp_widget_get_child_by_name(config, "cameramodel", &child);
+    const char *data = nullptr;
+    unsigned long size = 0;
     if (ret == GP_OK) {
-        ret = gp_widget_get_value(child, &value);
-        if (ret == GP_OK) {
-            CameraInfoTP[MODEL].setText(value);
-        } else {
-            LOG_ERROR("Failed to get camera model.");
-        }
-    } else {
-        LOG_ERROR("Camera model field not found.");
+        ret = gp_file_get_data_and_size(previewFile, &data, &size);
     }
-
-    // Get the serial number field
-    ret = gp_widget_get_child_by_name(config, "serialnumber", &child);
-    if (ret == GP_OK) {
-        ret = gp_widget_get_value(child, &value);
-        if (ret == GP_OK) {
-            CameraInfoTP[SERIAL].setText(value);
-        } else {
-            LOG_ERROR("Failed to get serial number.");
+    if (ret != GP_OK) {
+        // said once, the camera is asked again every so often
+        if (!previewFailing) {
+            LOGF_ERROR("The camera did not send a live view frame: %s", gp_result_as_string(ret));
         }
-    } else {
-        LOG_ERROR("Serial number field not found.");
+        previewFailing = true;
+
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        nextPreview = started + std::chrono::milliseconds(PREVIEW_RETRY_MS);
+        return;
     }
+    previewFailing = false;
 
-    // Get the version field
-    ret = gp_widget_get_child_by_name(config, "deviceversion", &child);
-    if (ret == GP_OK) {
-        ret = gp_widget_get_value(child, &value);
-        if (ret == GP_OK) {
-            CameraInfoTP[VERSION].setText(value);
-        } else {
-            LOG_ERROR("Failed to get device version.");
+    // frames are paced to what the client asked for, and dropped while it is still busy with the last one
+    // so a slow client doesn't hold up the camera
+    bool busy = Streamer->isBusy();
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        nextPreview = started + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1 / fps));
+        if (busy) {
+            previewDropped++;
+            return;
         }
-    } else {
-        LOG_ERROR("Device version field not found.");
+        previewFrames++;
     }
 
-    defineProperty(CameraInfoTP);
-
-    // Load the ISO param
-    ret = gp_widget_get_value(iso_w, &value);
-    if (ret == GP_OK) {
-        IsoNP[0].fill(
-            "ISO",
-            "ISO",
-            "%i",
-            iso_choices.begin()->first,
-            std::prev(iso_choices.end())->first,
-            1,
-            std::stoi(value)
-        );
-    } else {
-        LOG_ERROR("Failed to get camera iso.");
+    const uint8_t *jpeg = reinterpret_cast<const uint8_t *>(data);
+    int width, height;
+    if (jpegSize(jpeg, size, width, height) && (width != previewWidth || height != previewHeight)) {
+        LOGF_DEBUG("Live view frames are %ix%i", width, height);
+        previewWidth = width;
+        previewHeight = height;
+        Streamer->setSize(width, height);
     }
 
-    defineProperty(IsoNP);
-
-    return true;
+    Streamer->newFrame(jpeg, size);
 }
 
-bool LumixCameraDriver::getIso(int *iso) {
-    const char *value;
-    // Load the ISO param
-    int ret = gp_widget_get_value(iso_w, &value);
-    if (ret == GP_OK) {
-        *iso = std::stoi(value);
-        return true;
-    } else {
-        LOG_ERROR("Failed to get camera iso.");
-        return false;
+void LumixCameraDriver::prefetchSettings()
+{
+    ExposureSettings next;
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (captureRequest || burstLeft > 0 || planQueue.empty()) {
+            return;
+        }
+        next = planQueue.front().second;
+    }
+
+    // only what differs from the current settings goes to the camera
+    if (stageExposureSettings(next)) {
+        applyConfig();
     }
 }
 
-bool LumixCameraDriver::Connect()
+DownloadView LumixCameraDriver::waitForDownload(LumixFrame &frame, size_t bytes)
 {
-    // Connect to the camera
-    try {
-        if (!connect_to_lumix_camera()) {
-            LOG_ERROR("No Lumix camera found. Ensure it's connected and powered on.");
-            return false;
-        } else {
-            setupParams();
-        }
-    } catch (const std::exception& e) {
-        LOG_ERROR("Error connecting to camera");
+    std::unique_lock<std::mutex> lock(pipelineMutex);
+    pipelineCondition.wait(lock, [&frame, bytes] {
+        return !frame.downloading || (frame.fileSize > 0 && frame.received >= bytes);
+    });
 
-        return false;
+    DownloadView view;
+    if (frame.failed || frame.fileSize == 0) {
+        return view;
     }
+    view.data = frame.fileData.data();
+    view.size = frame.downloading ? frame.fileSize : frame.received;
+    view.available = frame.received;
+    return view;
+}
 
-    LOG_INFO("Connected to camera");
+bool LumixCameraDriver::waitForWholeFile(LumixFrame &frame)
+{
+    std::unique_lock<std::mutex> lock(pipelineMutex);
+    pipelineCondition.wait(lock, [&frame] {
+        return !frame.downloading;
+    });
 
-    return true;
+    return !frame.failed && frame.fileSize > 0 && frame.received == frame.fileSize;
 }
 
-bool LumixCameraDriver::Disconnect()
+void LumixCameraDriver::processingLoop(size_t index)
 {
-    // Disconnect from the camera
-    gp_camera_exit(camera, gpContext);
-    gp_camera_free(camera);
-    gp_context_unref(gpContext);
+    // every processing thread keeps its own decoder for as long as it runs, it is only recycled between frames
+    std::unique_ptr<LibRaw> raw_processor(new LibRaw());
 
-    LOG_INFO("Disconnected from camera");
+    while (true) {
+        std::unique_ptr<LumixFrame> frame;
+        bool wanted;
+        bool decode;
+        {
+            std::unique_lock<std::mutex> lock(pipelineMutex);
+            pipelineCondition.wait(lock, [this, index] {
+                return !pipelineRunning || index >= processingThreadCount || !processingQueue.empty();
+            });
+            if (!pipelineRunning || index >= processingThreadCount) {
+                return;
+            }
 
-    return true;
+            frame = std::move(processingQueue.front());
+            processingQueue.pop_front();
+            wanted = isAwaited(frame->id) || frame->id == speculativeId;
+            // frames that failed to capture are still passed on so the client hears about it
+            decode = wanted && !frame->failed;
+
+            if (decode && !frame->settings.native && !spareBuffers.empty()) {
+                frame->pixels = std::move(spareBuffers.back());
+                spareBuffers.pop_back();
+            }
+        }
+        // there is room for the capture thread again
+        pipelineCondition.notify_all();
+
+        // don't bother decoding frames that were aborted or superseded
+        int ret = 0;
+        if (decode && frame->settings.native) {
+            // the raw file goes to the client untouched, it only has to finish downloading
+            if (!waitForWholeFile(*frame)) {
+                LOG_ERROR("The RAW file did not download completely.");
+                ret = -1;
+            } else {
+                frame->format = "rw2";
+            }
+        } else if (decode) {
+            {
+                std::lock_guard<std::mutex> lock(pipelineMutex);
+                decoding[raw_processor.get()] = frame->id;
+            }
+            ret = processImage(*raw_processor, *frame);
+            {
+                std::lock_guard<std::mutex> lock(pipelineMutex);
+                decoding.erase(raw_processor.get());
+            }
+
+            // each processing thread compresses its own frame, so compressing is as parallel as decoding
+            if (ret == 0 && frame->format.empty() && frame->settings.compress) {
+                compressFrame(*frame);
+            }
+        }
+        raw_processor->recycle();
+        raw_processor->clear_cancel_flag();
+
+        // a quick look doesn't wait for the raw file that follows it
+        bool followUp = wanted && ret == 0 && !frame->format.empty() && frame->settings.rawFollowUp;
+        if (followUp) {
+            std::unique_ptr<LumixFrame> look = std::make_unique<LumixFrame>();
+            look->id       = frame->id;
+            look->settings = frame->settings;
+            look->pixels   = std::move(frame->pixels);
+            look->format   = frame->format;
+            look->width    = frame->width;
+            look->height   = frame->height;
+            look->channels = frame->channels;
+            look->bpp      = frame->bpp;
+            look->burst    = frame->burst;
+            look->planned  = frame->planned;
+
+            std::lock_guard<std::mutex> lock(pipelineMutex);
+            if (look->burst) {
+                burstProcessed++;
+                burstChanged = true;
+            }
+            completedFrames.push_back(std::move(look));
+            wanted = false;
+        }
+
+        // decoding can stop early, but the capture thread has to be done with the file before it goes away
+        bool complete = waitForWholeFile(*frame);
+
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+
+        if (followUp && complete) {
+            rawFollowUps.push_back({frame->path.name, std::move(frame->fileData)});
+        } else if (wanted && ret == 0 && frame->settings.native) {
+            // native frames are delivered straight out of the download buffer
+        } else if (spareFiles.size() < MAX_QUEUED_FRAMES) {
+            // the raw file isn't needed anymore, keep its buffer for the next download
+            spareFiles.push_back(std::move(frame->fileData));
+        }
+
+        if (!wanted) {
+            continue;
+        }
+        if (ret != 0) {
+            frame->failed = true;
+        } else if (frame->burst) {
+            burstProcessed++;
+            burstChanged = true;
+        }
+        completedFrames.push_back(std::move(frame));
+    }
 }
 
-bool LumixCameraDriver::getExposureValue(float duration, const char **value) {
-    if (ss_choices.empty()) {
-        LOG_ERROR("There are no possible shutter speeds. Try reconnecting your camera.");
+bool LumixCameraDriver::stageExposureSettings(const ExposureSettings &settings)
+{
+    if (useBulb(settings.duration)) {
+        if (!setConfigValue(ss, bulbChoice.c_str())) {
+            LOG_ERROR("Could not set camera mode to bulb.");
+            return false;
+        }
+    } else if (!setShutterSpeed(settings.duration)) {
+        LOG_ERROR("Could not set proper shutter speed!");
         return false;
     }
-
-        // Check if the target is out of bounds
-    if (duration < ss_choices.begin()->first || duration > std::prev(ss_choices.end())->first) {
-        LOG_ERROR("The set exposure time is outside the capabilities of your camera.");
+    if (!setIso(settings.iso)) {
+        LOG_ERROR("Could not set proper iso!");
         return false;
     }
 
-    // Use lower_bound to find the first element not less than target
-    auto lower = ss_choices.lower_bound(duration);
+    return true;
+}
 
-    // If lower is the beginning, return its value
-    if (lower == ss_choices.begin()) {
-        *value = lower->second;
-        return true;
-    }
-    // If lower is the end, return the previous element's value
-    if (lower == ss_choices.end()) {
-        *value = std::prev(lower)->second;
-        return true;
+bool LumixCameraDriver::captureImage(LumixFrame &frame)
+{
+    // everything that changed goes to the camera at once, nothing if this frame uses the same settings as the last
+    if (!stageExposureSettings(frame.settings) || !applyConfig()) {
+        return false;
     }
 
-    // Compare the element before `lower` with `lower` to find the closest
-    auto prev = std::prev(lower);
-    if (std::abs(duration - prev->first) <= std::abs(duration - lower->first)) {
-        *value = prev->second;
-        return true;
-    } else {
-        *value = lower->second;
-        return true;
+    if (useBulb(frame.settings.duration)) {
+        return bulbCapture(frame);
     }
-}
 
-bool LumixCameraDriver::getIsoChoiceValue(int iso, const char **value) {
-    if (iso_choices.empty()) {
-        LOG_ERROR("There are no possible iso values. Try reconnecting your camera.");
+    // the camera times the exposure itself, the file is picked up as soon as the camera reports it
+    int ret = gp_camera_trigger_capture(camera, gpContext);
+    if (ret < GP_OK) {
+        LOG_ERROR((std::string("Error starting exposure: ") + std::string(gp_result_as_string(ret))).c_str());
         return false;
     }
 
-    // Check if the target is out of bounds
-    if (iso < iso_choices.begin()->first || iso > std::prev(iso_choices.end())->first) {
-        LOG_ERROR("The set iso value is outside the capabilities of your camera.");
+    // queued deletions may run while the shutter is open, stopping a bit before it closes
+    auto busyUntil = std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds((int)(frame.settings.duration * 1000) - DELETE_MARGIN_MS);
+    if (!waitForFile(frame, frame.settings.duration * 1000 + FILE_TIMEOUT_MS, busyUntil)) {
         return false;
     }
+    LOG_INFO("Capture finished successfully!");
 
-    // Use lower_bound to find the first element not less than target
-    auto lower = iso_choices.lower_bound(iso);
+    return true;
+}
 
-    // If lower is the beginning, return its value
-    if (lower == iso_choices.begin()) {
-        *value = lower->second;
-        return true;
-    }
-    // If lower is the end, return the previous element's value
-    if (lower == iso_choices.end()) {
-        *value = std::prev(lower)->second;
-        return true;
+int LumixCameraDriver::nextFileAdded(CameraFilePath *path, int timeout)
+{
+    CameraEventType type;
+    void *data = nullptr;
+    int ret = gp_camera_wait_for_event(camera, timeout, &type, &data, gpContext);
+    if (ret < GP_OK) {
+        return ret;
     }
 
-    // Compare the element before `lower` with `lower` to find the closest
-    auto prev = std::prev(lower);
-    if (std::abs(iso - prev->first) <= std::abs(iso - lower->first)) {
-        *value = prev->second;
-        return true;
-    } else {
-        *value = lower->second;
-        return true;
+    bool added = type == GP_EVENT_FILE_ADDED;
+    if (added) {
+        *path = *static_cast<CameraFilePath *>(data);
     }
+    free(data);
+
+    return added ? 1 : 0;
 }
 
-bool LumixCameraDriver::setupParams()
+bool LumixCameraDriver::waitForFile(LumixFrame &frame, int timeout, std::chrono::steady_clock::time_point busyUntil)
 {
-    float x_pixel_size, y_pixel_size;
-    int bit_depth = 16; // valid values are 8, 16, 32
-    int x_1, y_1, x_2, y_2;
-    int channels = 3;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    bool found = false;
 
-    // TODO: Actually get the pixel size from the camera
-    x_pixel_size = 5.95;
-    y_pixel_size = 5.95;
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (cancelIo) {
+            if (!found) {
+                abortedCaptures++;
+            }
+            return false;
+        }
 
-    // TODO: Actually get the image size from the camera
-    x_1 = y_1 = 0;
-    x_2 = 6008;
-    y_2 = 4008;
+        // returns as soon as the camera has an event
+        CameraFilePath path;
+        int ret = nextFileAdded(&path, CAMERA_EVENT_WAIT_MS);
+        if (ret < GP_OK) {
+            LOGF_ERROR("Error waiting for the exposure: %s", gp_result_as_string(ret));
+            if (ret != GP_ERROR_CANCEL) {
+                reportStall("lost contact while exposing");
+            }
+            return false;
+        }
+        if (ret == 0) {
+            // the camera is exposing anyway, so deleting files in the meantime costs the frame nothing
+            deletePendingFiles(busyUntil, 1);
+            continue;
+        }
 
-    // Set the pixel size
-    SetCCDParams(x_2 - x_1, y_2 - y_1, bit_depth, x_pixel_size, y_pixel_size);
+        frame.path = path;
+        if (isRawFile(path.name)) {
+            return true;
+        }
 
-    // Set the channels
-    PrimaryCCD.setNAxis(channels);
+        // only the raw file is downloaded, the JPEG goes with it
+        if (!saveOnCamera) {
+            queueDelete(path);
+        }
 
-    // TODO: Now we usually do the following in the hardware
-    // Set Frame to LIGHT or NORMAL
-    // Set Binning to 1x1
-    /* Default frame type is NORMAL */
+        // in RAW+JPEG mode the raw file comes separately
+        if (!found) {
+            found = true;
+            deadline = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(RAW_FILE_FOLLOW_MS));
+        }
+    }
 
-    // Calculate the required buffer
-    int nbuf;
-    nbuf = PrimaryCCD.getXRes() * PrimaryCCD.getYRes() * ((PrimaryCCD.getBPP() * PrimaryCCD.getNAxis()) / 8); // this is the pixel count
-    nbuf += 512; // add some extra buffer
-    PrimaryCCD.setFrameBufferSize(nbuf);
+    if (!found) {
+        LOG_ERROR("The camera did not save the exposure.");
+        reportStall("did not save the exposure");
+    }
+    return found;
+}
 
-    return true;
+void LumixCameraDriver::queueDelete(const CameraFilePath &path)
+{
+    pendingDeletes.push_back(path);
+
+    if (!deleteJournal.empty()) {
+        std::ofstream journal(deleteJournal, std::ios::app);
+        journal << path.folder << '\t' << path.name << '\n';
+    }
 }
 
-bool LumixCameraDriver::setShutterSpeed(float duration) {
-    const char *value;
-    if (!getExposureValue(duration, &value)) {
-        return false;
+void LumixCameraDriver::deletePendingFiles(std::chrono::steady_clock::time_point until, size_t limit)
+{
+    size_t deleted = 0;
+    while (!pendingDeletes.empty() && deleted < limit && !cancelIo && std::chrono::steady_clock::now() < until) {
+        const CameraFilePath &path = pendingDeletes.front();
+        int ret = gp_camera_file_delete(camera, path.folder, path.name, gpContext);
+        if (ret == GP_ERROR_CAMERA_BUSY) {
+            // tried again later
+            break;
+        }
+        if (ret == GP_OK || ret == GP_ERROR_FILE_NOT_FOUND) {
+            LOGF_DEBUG("Deleted %s/%s from the camera, %i more to delete", path.folder, path.name, (int)pendingDeletes.size() - 1);
+        } else {
+            LOGF_WARN("Could not delete %s/%s from the camera: %s", path.folder, path.name, gp_result_as_string(ret));
+        }
+        pendingDeletes.pop_front();
+        deleted++;
     }
 
-    LOGF_INFO("Setting shutter speed to %s", value);
-    int ret = gp_widget_set_value(ss, value);
-    if (ret != GP_OK) {
-        LOGF_ERROR("Failed to set shutter speed to %s.", value);
-        return false;
+    if (deleted > 0) {
+        writeDeleteJournal();
     }
+}
 
-    // apply the changes
-    ret = gp_camera_set_config(camera, config, gpContext);
-    if (ret != GP_OK) {
-        LOG_ERROR("Failed to apply shutter speed to camera.");
-        return false;
+void LumixCameraDriver::loadDeleteJournal()
+{
+    // files the driver meant to delete but didn't get to before it was stopped
+    pendingDeletes.clear();
+    if (deleteJournal.empty()) {
+        return;
     }
 
-    return true;
+    std::ifstream journal(deleteJournal);
+    std::string line;
+    while (std::getline(journal, line)) {
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos) {
+            continue;
+        }
+        CameraFilePath path = {};
+        strncpy(path.folder, line.substr(0, tab).c_str(), sizeof(path.folder) - 1);
+        strncpy(path.name, line.substr(tab + 1).c_str(), sizeof(path.name) - 1);
+        pendingDeletes.push_back(path);
+    }
+
+    if (!pendingDeletes.empty()) {
+        LOGF_INFO("%i files left on the camera by the last session will be deleted.", (int)pendingDeletes.size());
+    }
 }
 
-bool LumixCameraDriver::setIso(int iso) {
-    const char *value;
-    if (!getIsoChoiceValue(iso, &value)) {
-        return false;
+void LumixCameraDriver::writeDeleteJournal()
+{
+    if (deleteJournal.empty()) {
+        return;
+    }
+    if (pendingDeletes.empty()) {
+        unlink(deleteJournal.c_str());
+        return;
     }
 
-    LOGF_INFO("Setting iso to %s", value);
-    int ret = gp_widget_set_value(iso_w, value);
-    if (ret != GP_OK) {
-        LOGF_ERROR("Failed to set iso to %s.", value);
-        return false;
+    std::ofstream journal(deleteJournal, std::ios::trunc);
+    for (auto &path : pendingDeletes) {
+        journal << path.folder << '\t' << path.name << '\n';
     }
+}
 
-    // apply the changes
-    ret = gp_camera_set_config(camera, config, gpContext);
-    if (ret != GP_OK) {
-        LOG_ERROR("Failed to apply iso to camera.");
+bool LumixCameraDriver::useBulb(float duration)
+{
+    if (!bulb_w || duration < BULB_MIN_DURATION) {
         return false;
     }
 
-    return true;
+    // preset shutter speeds are timed more precisely by the camera, so bulb is only used when none of them fits
+    auto preset = ss_choices.lower_bound(duration * 0.999f);
+    return preset == ss_choices.end() || preset->first > duration * 1.001f;
 }
 
-bool LumixCameraDriver::StartExposure(float duration)
+bool LumixCameraDriver::setBulb(bool open)
 {
-    // Set the exposure request
-    PrimaryCCD.setExposureDuration(duration);
-    ExposureRequest = duration;
+    int value = open ? 1 : 0;
+    int ret = gp_widget_set_value(bulb_w, &value);
+    if (ret == GP_OK) {
+        ret = gp_camera_set_single_config(camera, "bulb", bulb_w, gpContext);
+    }
+    if (ret != GP_OK) {
+        LOGF_ERROR("Could not %s the shutter: %s", open ? "open" : "close", gp_result_as_string(ret));
+        return false;
+    }
 
-    // start the takePhoto process in a separate thread
-    std::thread([this, duration] {
-        // int ret = gp_widget_set_value(ss, "bulb");
-        // if (ret < GP_OK) {
-        //     LOG_ERROR("Could not set camera mode to bulb.");
-        //     return;
-        // }
-
-        // ret = gp_camera_set_config(camera, config, gpContext);
-        // if (ret < GP_OK) {
-        //     LOG_ERROR("Could not update camera config.");
-        //     return;
-        // }
-        if (!setShutterSpeed(duration)) {
-            LOG_ERROR("Could not set proper shutter speed!");
-            return;
-        }
+    return true;
+}
 
-        isExposing = true;
+bool LumixCameraDriver::bulbCapture(LumixFrame &frame)
+{
+    using Clock = std::chrono::steady_clock;
 
-        // only open the shutter because of bulb mode
-        int ret = gp_camera_capture(camera, GP_CAPTURE_IMAGE, &filePath, gpContext);;
-        if (ret < GP_OK) {
-            LOG_ERROR((std::string("Error starting exposure: ") + std::string(gp_result_as_string(ret))).c_str());
-        }
-        LOG_INFO("Capture finished successfully!");
+    auto opening = Clock::now();
+    if (!setBulb(true)) {
+        return false;
+    }
+    auto opened = Clock::now();
+    auto deadline = opened + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(frame.settings.duration));
 
-        //sleep(duration);
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        // exposure left is counted from when the shutter actually opened
+        capturingStarted = opened;
+    }
 
-        // close the shutter
-        // ret = gp_camera_trigger_capture(camera, gpContext);
-        // if (ret < GP_OK) {
-        //     LOG_ERROR((std::string("Error stopping exposure: ") + std::string(gp_result_as_string(ret))).c_str());
-        // }
+    // long exposures leave time to delete files, stopping well before the shutter has to close
+    deletePendingFiles(deadline - std::chrono::milliseconds(DELETE_MARGIN_MS), SIZE_MAX);
 
-        isExposing = false;
-    }).detach();
+    {
+        std::unique_lock<std::mutex> lock(pipelineMutex);
 
-    m_ElapsedTimer.start();
-    InExposure = true;
+        // sleep on the monotonic clock, waking up early only when the exposure is aborted or the pipeline stops
+        pipelineCondition.wait_until(lock, deadline, [this] {
+            return !pipelineRunning || cancelIo;
+        });
+    }
+    auto woke = Clock::now();
+
+    // the shutter has to be closed even when aborting, so that command mustn't be cancelled. The cancel itself
+    // stays raised for the abort or stall recovery of the capture thread, which clears it
+    bool cancelled = cancelIo;
+    closingShutter = true;
+    bool closed = setBulb(false);
+    closingShutter = false;
+    auto closedAt = Clock::now();
+    if (cancelled) {
+        bool aborted;
+        {
+            std::lock_guard<std::mutex> lock(pipelineMutex);
+            aborted = aborting;
+        }
+        if (aborted) {
+            LOGF_INFO("Bulb exposure aborted after %.3f s", std::chrono::duration<double>(woke - opened).count());
+            abortedCaptures++;
+        } else {
+            LOGF_WARN("Bulb exposure interrupted after %.3f s", std::chrono::duration<double>(woke - opened).count());
+        }
+        return false;
+    }
+    if (!closed) {
+        return false;
+    }
 
-    return true;
-}
+    auto ms = [](Clock::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    LOGF_INFO("Bulb exposure of %.3f s (requested %.3f s): wake-up jitter %.2f ms, open took %.1f ms, close took %.1f ms",
+              std::chrono::duration<double>(closedAt - opened).count(), frame.settings.duration,
+              ms(woke - deadline), ms(opened - opening), ms(closedAt - woke));
 
-bool LumixCameraDriver::AbortExposure()
-{
-    // TODO: actually abort the exposure
-    InExposure = false;
+    // the file shows up once the camera is done writing it
+    if (!waitForFile(frame, FILE_TIMEOUT_MS)) {
+        return false;
+    }
+    LOGF_INFO("Bulb exposure saved after %.1f ms", ms(Clock::now() - closedAt));
 
     return true;
 }
@@ -710,45 +3355,36 @@ bool LumixCameraDriver::UpdateCCDFrameType(INDI::CCDChip::CCD_FRAME fType) {
 }
 
 bool LumixCameraDriver::UpdateCCDFrame(int x, int y, int w, int h) {
-    // add the x and y offsets
+    // the subframe is given in UNBINNED pixels
     long x_1 = x;
     long y_1 = y;
 
-    long bin_width = x_1 + (w / PrimaryCCD.getBinX());
-    long bin_height = y_1 + (h / PrimaryCCD.getBinY());
-
-    if (bin_width > PrimaryCCD.getXRes() / PrimaryCCD.getBinX()) {
+    if (x_1 + w > PrimaryCCD.getXRes()) {
         LOG_INFO("Error: X offset + width is greater than the CCD width");
 
         return false;
-    } else if (bin_height > PrimaryCCD.getYRes() / PrimaryCCD.getBinY()) {
+    } else if (y_1 + h > PrimaryCCD.getYRes()) {
         LOG_INFO("Error: Y offset + height is greater than the CCD height");
 
         return false;
     }
 
-    /**********************************************************
-    *
-    *
-    *
-    *  TODO: Put here your CCD Frame dimension call
-    *  The values calculated above are BINNED width and height
-    *  which is what most CCD APIs require, but in case your
-    *  CCD API implementation is different, don't forget to change
-    *  the above calculations.
-    *  If there is an error, report it back to client
-    *  e.g.
-    *  LOG_INFO( "Error, unable to set frame to ...");
-    *  return false;
-    *
-    *
-    **********************************************************/
+    // the camera always captures the full sensor, the subframe is cropped out of the raw data when decoding
 
     // set UNBINNED coords
-    PrimaryCCD.setFrame(x_1, y_1, bin_width, bin_height);
+    PrimaryCCD.setFrame(x_1, y_1, w, h);
+
+    // binning happens in software, so the frame only has to hold the binned pixels
+    int scale = getOutputScale();
+    long bin_width = w / (PrimaryCCD.getBinX() * scale);
+    long bin_height = h / (PrimaryCCD.getBinY() * scale);
+
+    // the channel count depends on the raw and binning modes (a single channel mosaic is a 2 axis image)
+    int channels = getOutputChannels();
+    PrimaryCCD.setNAxis(channels == 1 ? 2 : 3);
 
     int nbuf;
-    nbuf = (bin_width * bin_height * PrimaryCCD.getNAxis() * PrimaryCCD.getBPP() / 8); // this is the pixel count
+    nbuf = (bin_width * bin_height * channels * PrimaryCCD.getBPP() / 8); // this is the pixel count
     nbuf += 512; // add some extra buffer
     PrimaryCCD.setFrameBufferSize(nbuf);
 
@@ -757,88 +3393,276 @@ bool LumixCameraDriver::UpdateCCDFrame(int x, int y, int w, int h) {
 
 bool LumixCameraDriver::UpdateCCDBin(int binx, int biny)
 {
-    /**********************************************************
-    *
-    *
-    *
-    *  TODO: Put here your CCD Binning call
-    *  If there is an error, report it back to client
-    *  e.g.
-    *  LOG_INFO( "Error, unable to set binning to ...");
-    *  return false;
-    *
-    *
-    **********************************************************/
+    // binning is done in software on the decoded (or raw) data when the frame is processed
+    if (BinModeSP.findOnSwitchIndex() == BIN_SUPERPIXEL && (binx > 1 || biny > 1) && (binx % 2 != 0 || biny % 2 != 0)) {
+        LOG_ERROR("Superpixel binning needs an even binning factor (2x2 or 4x4).");
+        return false;
+    }
 
     PrimaryCCD.setBin(binx, biny);
 
     return UpdateCCDFrame(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
 }
 
-int LumixCameraDriver::downloadImage()
-{
-    uint8_t *image = PrimaryCCD.getFrameBuffer();
-    int width      = PrimaryCCD.getSubW() / PrimaryCCD.getBinX();
-    int height     = PrimaryCCD.getSubH() / PrimaryCCD.getBinY();
-    int bpp        = PrimaryCCD.getBPP();
-    int channels   = PrimaryCCD.getNAxis();
-
-    /**********************************************************
-     *
-     *
-     *  TODO: Put here your CCD Get Image routine here
-     *  use the image, width, and height variables above
-     *  If there is an error, report it back to client
-     *
-     *
-     **********************************************************/
-    // For now, just fill the image with random data
-    /*for (int i = 0; i < height; i++)
-        for (int j = 0; j < width; j++)
-            image[i * width + j] = rand() % 255;*/
-
+int LumixCameraDriver::downloadImage(LumixFrame &frame)
+{
     LOG_INFO("Starting Copy...");
 
+    // TODO: add support for non raw images
+    bool raw = isRawFile(frame.path.name);
+
     // download the photo
+    int ret = raw ? streamFile(frame) : GP_OK;
+    if (ret < GP_OK) {
+        LOG_ERROR("Failed to download image from camera...");
+        return -1;
+    }
+
+    // delete image off of camera if set to not save on camera, once the camera has time for it
+    // so the frame doesn't wait for it. A frame exposed ahead only keeps its file once the client claims it
+    bool keep = saveOnCamera;
+    if (frame.speculative) {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (frame.id == speculativeId) {
+            // still undecided, the claim or the drop takes care of the file
+            speculativePath = frame.path;
+            keep = true;
+        } else if (!isAwaited(frame.id)) {
+            keep = false;
+        }
+    }
+    if (!keep) {
+        queueDelete(frame.path);
+    }
+
+    if (!raw) {
+        LOG_ERROR("This driver currently does not support non-RW2 files. Please select RAW picture quality on your camera.");
+        return -1;
+    }
+
+    return 0;
+}
+
+int LumixCameraDriver::streamFile(LumixFrame &frame)
+{
+    const char *folder = frame.path.folder;
+    const char *name = frame.path.name;
+    auto started = std::chrono::steady_clock::now();
+
+    // read the file in chunks straight into the frame's buffer, publishing every chunk to the processing threads
+    CameraFileInfo info;
+    int ret = gp_camera_file_get_info(camera, folder, name, &info, gpContext);
+    if (ret >= GP_OK && (info.file.fields & GP_FILE_INFO_SIZE) && info.file.size > 0) {
+        uint64_t fileSize = info.file.size;
+
+        {
+            // readers may be in the buffer once anything has arrived, from then on it must not move
+            std::lock_guard<std::mutex> lock(pipelineMutex);
+            if (frame.received == 0) {
+                frame.fileData.resize(fileSize);
+            } else if (frame.fileData.size() != fileSize) {
+                LOGF_ERROR("%s changed size between download attempts.", name);
+                return GP_ERROR_IO;
+            }
+            frame.fileSize = fileSize;
+        }
+        pipelineCondition.notify_all();
+
+        // a retried download picks up where the last attempt stopped
+        uint64_t offset = std::min<uint64_t>(frame.received, fileSize);
+        while (offset < fileSize) {
+            if (cancelIo) {
+                LOGF_INFO("Download of %s cancelled.", name);
+                return GP_ERROR_CANCEL;
+            }
+
+            auto chunkStarted = std::chrono::steady_clock::now();
+            uint64_t size = std::min(DOWNLOAD_CHUNK_SIZE, fileSize - offset);
+
+            // on PTP cameras the RW2 is the file itself, partial reads only exist for the normal file type
+            ret = gp_camera_file_read(camera, folder, name, GP_FILE_TYPE_NORMAL, offset, frame.fileData.data() + offset, &size, gpContext);
+            if (ret == GP_ERROR_NOT_SUPPORTED && offset == 0) {
+                LOG_DEBUG("The camera doesn't support partial reads, downloading the whole file.");
+                break;
+            }
+            if (ret < GP_OK || size == 0) {
+                LOGF_ERROR("Reading %s failed at %llu of %llu bytes: %s", name, (unsigned long long)offset,
+                           (unsigned long long)fileSize, gp_result_as_string(ret < GP_OK ? ret : GP_ERROR_IO));
+                if (ret != GP_ERROR_CANCEL) {
+                    reportStall("lost contact while downloading");
+                }
+                return ret < GP_OK ? ret : GP_ERROR_IO;
+            }
+            offset += size;
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - chunkStarted).count();
+            LOGF_DEBUG("Chunk of %llu bytes at %llu in %.1f ms (%.1f MB/s)", (unsigned long long)size, (unsigned long long)(offset - size),
+                       seconds * 1000, size / std::max(seconds, 1e-6) / 1e6);
+
+            bool done;
+            {
+                std::lock_guard<std::mutex> lock(pipelineMutex);
+                frame.received = offset;
+                done = frame.downloadDone;
+            }
+            pipelineCondition.notify_all();
+
+            if (done && offset < fileSize) {
+                LOGF_INFO("Stopped downloading %s after %.1f of %.1f MB, the rest isn't needed.", name, offset / 1e6, fileSize / 1e6);
+                return GP_OK;
+            }
+        }
+
+        if (offset == fileSize) {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            LOGF_INFO("Downloaded %s (%.1f MB) in %.2f s (%.1f MB/s)", name, fileSize / 1e6, seconds, fileSize / std::max(seconds, 1e-6) / 1e6);
+            return GP_OK;
+        }
+    }
+
     CameraFile *file = nullptr;
     gp_file_new(&file);
 
-    int ret = gp_camera_file_get(camera, filePath.folder, filePath.name, GP_FILE_TYPE_RAW, file, gpContext);
+    ret = gp_camera_file_get(camera, folder, name, GP_FILE_TYPE_RAW, file, gpContext);
     if (ret < GP_OK) {
-        LOG_ERROR("Failed to download image from camera...");
-        return -1;
+        gp_file_free(file);
+        return ret;
     }
 
     const char *data;
     unsigned long int size;
     gp_file_get_data_and_size(file, &data, &size);
+    {
+        // the buffer may already be published, so it only changes under the lock, and only the part nobody reads yet
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (frame.received == 0) {
+            frame.fileData.assign(data, data + size);
+        } else if (frame.fileData.size() == size) {
+            memcpy(frame.fileData.data() + frame.received, data + frame.received, size - frame.received);
+        } else {
+            LOGF_ERROR("%s changed size between download attempts.", name);
+            gp_file_free(file);
+            return GP_ERROR_IO;
+        }
+        frame.fileSize = size;
+        frame.received = size;
+    }
+    gp_file_free(file);
+    pipelineCondition.notify_all();
 
-    // TODO: add support for non raw images
-    std::string filename = filePath.name;
-    if (filename.substr(filename.find_last_of(".") + 1) != "RW2") {
-        LOG_ERROR("This driver currently does not support non-RW2 files. Please select RAW picture quality on your camera.");
-        return -1;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    LOGF_INFO("Downloaded %s (%.1f MB) in %.2f s (%.1f MB/s)", name, size / 1e6, seconds, size / std::max(seconds, 1e-6) / 1e6);
+
+    return GP_OK;
+}
+
+bool LumixCameraDriver::processQuickLook(LibRaw &raw_processor, LumixFrame &frame)
+{
+    // the embedded preview sits ahead of the raw data, so it is usually there long before the download is done
+    const libraw_thumbnail_t &thumbnail = raw_processor.imgdata.thumbnail;
+    if (raw_processor.unpack_thumb() != LIBRAW_SUCCESS || thumbnail.tformat != LIBRAW_THUMBNAIL_JPEG) {
+        return false;
+    }
+
+    frame.pixels.assign(thumbnail.thumb, thumbnail.thumb + thumbnail.tlength);
+    frame.format   = "jpg";
+    frame.width    = thumbnail.twidth;
+    frame.height   = thumbnail.theight;
+    frame.channels = 3;
+    frame.bpp      = 8;
+
+    // without the raw file to follow, the rest of it doesn't have to come off the camera
+    if (!frame.settings.rawFollowUp) {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        frame.downloadDone = true;
     }
 
-    // start decoding Raw image
-    LibRaw raw_processor;
-    int raw_ret = raw_processor.open_buffer(data, size);
+    LOGF_INFO("Quick look of %ix%i from the camera's preview", frame.width, frame.height);
+    return true;
+}
+
+int LumixCameraDriver::processImage(LibRaw &raw_processor, LumixFrame &frame)
+{
+    const ExposureSettings &settings = frame.settings;
+    int width      = settings.subW / settings.binX;
+    int height     = settings.subH / settings.binY;
+    int bpp        = settings.bpp;
+    int channels   = settings.channels;
+
+    // start decoding Raw image, the header comes first so it is parsed while the rest is still downloading
+    DownloadDatastream stream([this, &frame](size_t bytes) {
+        return waitForDownload(frame, bytes);
+    });
+    int raw_ret = raw_processor.open_datastream(&stream);
     if (raw_ret != LIBRAW_SUCCESS) {
         LOG_ERROR("Could not load camera RAW file into LibRaw.");
         return -1;
     }
 
+    if (settings.quality == QUALITY_QUICK_LOOK) {
+        if (processQuickLook(raw_processor, frame)) {
+            return 0;
+        }
+        LOG_WARN("The raw file has no JPEG preview, processing it in full.");
+    }
+
+    // get the output buffer ready in the meantime too, every path below writes the whole of it
+    frame.pixels.resize(static_cast<size_t>(width) * height * channels * (bpp / 8));
+
     // Unpack the RAW data
     raw_ret = raw_processor.unpack();
+    if (!waitForWholeFile(frame)) {
+        LOG_ERROR("The RAW file did not download completely.");
+        return -1;
+    }
     if (raw_ret != LIBRAW_SUCCESS) {
         LOG_ERROR("Unable to unpack the RAW data.");
         return -11;
     }
 
+    // the frame geometry follows the sensor of the camera that is actually connected
+    noteSensorSize(raw_processor.imgdata.sizes.width, raw_processor.imgdata.sizes.height);
+
+    // the mosaic is used directly, so there is nothing left for LibRaw to do
+    if (settings.rawBayer || settings.superpixel) {
+        return processMosaic(raw_processor, frame);
+    }
+
+    // the built in pipeline replaces dcraw_process for linear frames
+    if (settings.quality == QUALITY_LINEAR) {
+        return processLinear(raw_processor, frame);
+    }
+
+    // only demosaic the part of the sensor the subframe needs, with a small border so the
+    // interpolation at the subframe edges still sees its neighbours
+    libraw_image_sizes_t &sizes = raw_processor.imgdata.sizes;
+    if (settings.subX + settings.subW > sizes.width || settings.subY + settings.subH > sizes.height) {
+        LOGF_ERROR("Error: Subframe does not fit on the %ix%i sensor", sizes.width, sizes.height);
+        return -1;
+    }
+
+    // the crop stays aligned to the 2x2 CFA cell so the Bayer pattern doesn't shift
+    const int border = 8;
+    int cropX = std::max(0, settings.subX - border) & ~1;
+    int cropY = std::max(0, settings.subY - border) & ~1;
+    int cropW = std::min<int>(sizes.width, (settings.subX + settings.subW + border + 1) & ~1) - cropX;
+    int cropH = std::min<int>(sizes.height, (settings.subY + settings.subH + border + 1) & ~1) - cropY;
+
     // Set processing parameters
     libraw_output_params_t* params = raw_processor.output_params_ptr();
+    // dcraw_process restores the sizes from the raw data before it copies the visible area out of it,
+    // so the crop has to go through cropbox, which it applies on top (the decoder is reused, so this is always set)
+    bool crop = cropW != sizes.width || cropH != sizes.height;
+    params->cropbox[0] = crop ? cropX : 0;
+    params->cropbox[1] = crop ? cropY : 0;
+    params->cropbox[2] = crop ? cropW : 0;
+    params->cropbox[3] = crop ? cropH : 0;
     // always upsampled to 16 bits
     params->output_bps = 16; // Use 16 bits per channel
+    // the frame keeps the sensor orientation, the subframe is given in sensor coordinates
+    params->user_flip = 0;
+    // bilinear is much cheaper than the default AHD, the decoder is reused so this is always set
+    params->user_qual = settings.quality == QUALITY_BILINEAR ? 0 : -1;
 
     // Process image to include color and debayer step
     if (raw_processor.dcraw_process() != LIBRAW_SUCCESS) {
@@ -846,49 +3670,496 @@ int LumixCameraDriver::downloadImage()
         return -1;
     }
 
-    // Get the processed image data
-    libraw_processed_image_t* raw_image = raw_processor.dcraw_make_mem_image();
-    if (!raw_image) {
-        LOG_ERROR("Unable to allocate memory for the processed image.");
+    // the processed image is read straight out of LibRaw's working image instead of having
+    // dcraw_make_mem_image allocate an interleaved copy of it. Where the crop ended up is taken from LibRaw
+    // rather than assumed, it may align the box differently (or ignore it, then the whole sensor is processed)
+    const libraw_image_sizes_t &rawSizes = raw_processor.imgdata.rawdata.sizes;
+    cropX = sizes.left_margin - rawSizes.left_margin;
+    cropY = sizes.top_margin - rawSizes.top_margin;
+    cropW = sizes.iwidth;
+    cropH = sizes.iheight;
+    LOGF_INFO("Raw Image size: %ix%i at %i,%i, Subframe: %ix%i at %i,%i", cropW, cropH, cropX, cropY,
+              settings.subW, settings.subH, settings.subX, settings.subY);
+    LOGF_INFO("Width: %i, Height: %i, Channels: %i, BPP: %i", width, height, channels, bpp);
+    if (settings.subX < cropX || settings.subY < cropY ||
+        settings.subX + settings.subW > cropX + cropW || settings.subY + settings.subH > cropY + cropH ||
+        raw_processor.imgdata.idata.colors != channels || bpp != 16 || !raw_processor.imgdata.image) {
+        LOG_ERROR("Error: Image size does not match expected size");
         return -1;
     }
 
-    LOGF_INFO("Raw Image size: %i, Expected Size: %i", raw_image->data_size, (width * height * channels * (bpp / 8.0)));
-    LOGF_INFO("Width: %i, Height: %i, Channels: %i, BPP: %i", width, height, channels, bpp);
-    if (raw_image->data_size != (width * height * channels * (bpp / 8.0))) {
+    // build the output curve the way dcraw_make_mem_image does, brightening unless told not to
+    int white = 0x2000;
+    if (!((params->highlight & ~2) || params->no_auto_bright)) {
+        size_t clipCount = sizes.width * sizes.height * params->auto_bright_thr;
+        white = autoBrightWhite(raw_processor.imgdata.image, sizes.iwidth, sizes.iheight, channels, clipCount);
+    }
+    ushort *curve = raw_processor.imgdata.color.curve;
+    gammaCurve(params->gamm[0], params->gamm[1], (white << 3) / params->bright, curve);
+
+    // map, bin and split the subframe window of the processed image into rrr...ggg...bbb... planes
+    const ushort (*window)[4] = raw_processor.imgdata.image + (settings.subY - cropY) * cropW + (settings.subX - cropX);
+    quadToPlanar16(window, cropW, settings.subW, settings.subH, channels, curve,
+                   settings.binX, settings.binY, settings.binSum, reinterpret_cast<uint16_t *>(frame.pixels.data()));
+
+    frame.width = width;
+    frame.height = height;
+    frame.channels = channels;
+    frame.bpp = bpp;
+
+    return 0;
+}
+
+int LumixCameraDriver::processMosaic(LibRaw &raw_processor, LumixFrame &frame)
+{
+    const ExposureSettings &settings = frame.settings;
+    int width  = settings.subW / settings.binX;
+    int height = settings.subH / settings.binY;
+
+    const libraw_image_sizes_t &sizes = raw_processor.imgdata.sizes;
+    const ushort *raw = raw_processor.imgdata.rawdata.raw_image;
+    if (!raw || raw_processor.imgdata.idata.filters == 0) {
+        LOG_ERROR("The RAW file does not contain Bayer data.");
+        return -1;
+    }
+
+    LOGF_INFO("Sensor Size: %ix%i, Subframe: %ix%i at %i,%i", sizes.width, sizes.height, settings.subW, settings.subH, settings.subX, settings.subY);
+    LOGF_INFO("Width: %i, Height: %i, Bin: %ix%i", width, height, settings.binX, settings.binY);
+    if (settings.subX + settings.subW > sizes.width || settings.subY + settings.subH > sizes.height || settings.bpp != 16) {
         LOG_ERROR("Error: Image size does not match expected size");
+        return -1;
+    }
+
+    // the raw rows include the masked margins around the visible part of the sensor,
+    // only the subframe window is read from them
+    int pitch = sizes.raw_pitch / sizeof(ushort);
+    const ushort *origin = raw + (sizes.top_margin + settings.subY) * pitch + sizes.left_margin + settings.subX;
+
+    // describe the CFA as seen from the frame origin
+    const char *cdesc = raw_processor.imgdata.idata.cdesc;
+    int pattern[4];
+    frame.bayerPattern.clear();
+    for (int row = 0; row < 2; row++) {
+        for (int col = 0; col < 2; col++) {
+            int color = raw_processor.COLOR(settings.subY + row, settings.subX + col);
+            // cdesc is "RGBG", so both greens come out as G
+            frame.bayerPattern += cdesc[color];
+            pattern[row * 2 + col] = color == 3 ? 1 : color;
+        }
+    }
 
+    if (settings.superpixel) {
+        uint16_t *planes = reinterpret_cast<uint16_t *>(frame.pixels.data());
+        superpixel16(origin, pitch, settings.subW, settings.subH, pattern, settings.binX, settings.binY, planes);
+        frame.channels = 3;
+
+        // superpixel binning keeps the raw values, a half size frame is a draft of the full quality one
+        if (settings.quality == QUALITY_HALF_SIZE) {
+            developHalfSize(raw_processor, planes, static_cast<size_t>(width) * height);
+        }
+    } else {
+        ushort *image = reinterpret_cast<ushort *>(frame.pixels.data());
+        if (settings.binX > 1 || settings.binY > 1) {
+            binBayer16(origin, pitch, settings.subW, settings.subH, settings.binX, settings.binY, settings.binSum, image);
+        } else {
+            for (int row = 0; row < height; row++) {
+                memcpy(image + row * width, origin + row * pitch, width * sizeof(ushort));
+            }
+        }
+        frame.channels = 1;
+    }
+
+    frame.width = width;
+    frame.height = height;
+    frame.bpp = 16;
+
+    return 0;
+}
+
+void LumixCameraDriver::developHalfSize(LibRaw &raw_processor, uint16_t *planes, size_t planeSize)
+{
+    // the same steps dcraw_process and its output take for a full quality frame: black level, the white balance
+    // LibRaw is set to use, the camera to sRGB matrix, then auto brightening and the gamma curve
+    const libraw_colordata_t &color = raw_processor.imgdata.color;
+    const libraw_output_params_t &params = raw_processor.imgdata.params;
+    bool cameraBalance = params.use_camera_wb && color.cam_mul[0] > 0;
+    int pattern[4];
+    CfaScale cell = cfaScale(raw_processor, cameraBalance ? color.cam_mul : color.pre_mul, pattern);
+
+    // the superpixels average the sites of each colour, so their levels are averaged the same way
+    float black[3] = {0, 0, 0}, gain[3] = {0, 0, 0};
+    int sites[3] = {0, 0, 0};
+    for (int s = 0; s < 4; s++) {
+        black[pattern[s]] += cell.black[s];
+        gain[pattern[s]] += cell.gain[s];
+        sites[pattern[s]]++;
+    }
+    for (int c = 0; c < 3; c++) {
+        black[c] = sites[c] ? black[c] / sites[c] : 0;
+        gain[c] = sites[c] ? gain[c] / sites[c] : 1;
+    }
+
+    float matrix[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            matrix[i][j] = params.output_color == 0 ? (i == j ? 1.0f : 0.0f) : color.rgb_cam[i][j];
+        }
+    }
+    developPlanes16(planes, planeSize, black, gain, matrix);
+
+    int white = 0x2000;
+    if (!((params.highlight & ~2) || params.no_auto_bright)) {
+        white = autoBrightWhitePlanes(planes, planeSize, 3, planeSize * params.auto_bright_thr);
+    }
+    ushort *curve = raw_processor.imgdata.color.curve;
+    gammaCurve(params.gamm[0], params.gamm[1], (white << 3) / params.bright, curve);
+    applyCurve16(planes, planeSize * 3, curve);
+}
+
+int LumixCameraDriver::processLinear(LibRaw &raw_processor, LumixFrame &frame)
+{
+    const ExposureSettings &settings = frame.settings;
+    int width  = settings.subW / settings.binX;
+    int height = settings.subH / settings.binY;
+
+    const libraw_image_sizes_t &sizes = raw_processor.imgdata.sizes;
+    const libraw_colordata_t &color = raw_processor.imgdata.color;
+    const ushort *raw = raw_processor.imgdata.rawdata.raw_image;
+    if (!raw || raw_processor.imgdata.idata.filters == 0) {
+        LOG_ERROR("The RAW file does not contain Bayer data.");
+        return -1;
+    }
+    if (settings.subX + settings.subW > sizes.width || settings.subY + settings.subH > sizes.height ||
+        settings.channels != 3 || settings.bpp != 16) {
+        LOG_ERROR("Error: Image size does not match expected size");
         return -1;
     }
 
-    // the numbers of bytes per pixel (think of as Pixel Bytes)
-    int pb = bpp/8;
+    // white balance as shot, so nothing is darkened
+    int pattern[4];
+    const float *shot = color.cam_mul[0] > 0 ? color.cam_mul : color.pre_mul;
+    CfaScale scale = cfaScale(raw_processor, settings.whiteBalance ? shot : nullptr, pattern);
+
+    LOGF_INFO("Sensor Size: %ix%i, Subframe: %ix%i at %i,%i", sizes.width, sizes.height, settings.subW, settings.subH, settings.subX, settings.subY);
+    LOGF_INFO("Width: %i, Height: %i, Bin: %ix%i, Black: %.0f, White: %u", width, height, settings.binX, settings.binY, scale.black[0], color.maximum);
+
+    // the raw rows include the masked margins around the visible part of the sensor
+    int pitch = sizes.raw_pitch / sizeof(ushort);
+    const ushort *origin = raw + sizes.top_margin * pitch + sizes.left_margin;
+
+    uint16_t *planes = reinterpret_cast<uint16_t *>(frame.pixels.data());
+    if (settings.vng) {
+        demosaicVNG16(origin, pitch, sizes.width, sizes.height, pattern, scale, settings.subX, settings.subY,
+                      settings.subW, settings.subH, settings.binX, settings.binY, settings.binSum, planes);
+    } else {
+        demosaicBilinear16(origin, pitch, sizes.width, sizes.height, pattern, scale, settings.subX, settings.subY,
+                           settings.subW, settings.subH, settings.binX, settings.binY, settings.binSum, planes);
+    }
+
+    frame.width = width;
+    frame.height = height;
+    frame.channels = 3;
+    frame.bpp = 16;
 
-    // Copy rgbrgb... format from raw_image to rrr...ggg...bbb... in the Indi pixel buffer
-    for (int i = 0; i < width*height; i++) {
-        for (int c = 0; c < channels; c++) {
-            int srcIndex = i * channels * pb + c * pb;
-            int destIndex = width * height * c * pb + i * pb;
+    return 0;
+}
+
+void LumixCameraDriver::deliverFrames()
+{
+    std::unique_ptr<LumixFrame> frame;
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+
+        // nobody is waiting on these frames anymore
+        completedFrames.erase(std::remove_if(completedFrames.begin(), completedFrames.end(),
+            [this](const std::unique_ptr<LumixFrame> &completed) {
+                return completed->id != speculativeId && !isAwaited(completed->id);
+            }), completedFrames.end());
+
+        // the processing threads can finish out of order, but frames are delivered in the order they were requested
+        if (!awaitedFrames.empty()) {
+            auto next = std::find_if(completedFrames.begin(), completedFrames.end(),
+                [this](const std::unique_ptr<LumixFrame> &completed) {
+                    return completed->id == awaitedFrames.front();
+                });
+            if (next != completedFrames.end()) {
+                frame = std::move(*next);
+                completedFrames.erase(next);
+                awaitedFrames.pop_front();
+                burstChanged = burstChanged || frame->burst;
+            }
+        }
+    }
+
+    if (!frame) {
+        return;
+    }
+
+    if (frame->planned) {
+        planDone++;
+        PlanProgressNP[PLAN_DONE].setValue(planDone);
+        PlanProgressNP.setState(planDone < planTotal ? IPS_BUSY : IPS_OK);
+        PlanProgressNP.apply();
+        if (planDone == planTotal) {
+            LOG_INFO("The exposure plan is done.");
+            PlanSP.setState(IPS_OK);
+            PlanSP.apply();
+        }
+    }
+
+    if (frame->failed) {
+        LOG_ERROR("Failed to download or process the image.");
+        PrimaryCCD.setExposureFailed();
+        return;
+    }
+
+    if (!frame->format.empty()) {
+        // the image goes to the client as the file it is, lent to the chip in place of its frame buffer
+        bool native = frame->settings.native;
+        uint8_t *data = native ? reinterpret_cast<uint8_t *>(frame->fileData.data()) : frame->pixels.data();
+        size_t size = native ? frame->fileData.size() : frame->pixels.size();
+
+        if (native) {
+            NativeFrameTP[NATIVE_FILE].setText(frame->path.name);
+            NativeFrameTP[NATIVE_INSTRUMENT].setText(std::string(CameraInfoTP[MANUFACTURER].getText()) + " " + CameraInfoTP[MODEL].getText());
+            NativeFrameTP[NATIVE_EXPOSURE].setText(std::to_string(frame->settings.duration));
+            NativeFrameTP[NATIVE_ISO].setText(std::to_string(frame->settings.iso));
+            NativeFrameTP.setState(IPS_OK);
+            NativeFrameTP.apply();
+            LOGF_INFO("Sending %s as it is (%.1f MB).", frame->path.name, size / 1e6);
+        }
+
+        std::string extension = PrimaryCCD.getImageExtension();
+        uint8_t *buffer = PrimaryCCD.getFrameBuffer();
+        uint32_t bufferSize = PrimaryCCD.getFrameBufferSize();
+        PrimaryCCD.setImageExtension(frame->format.c_str());
+        PrimaryCCD.setFrameBuffer(data);
+        PrimaryCCD.setFrameBufferSize(size, false);
 
-            for (int b = 0; b < pb; b++) {
-                image[destIndex+b] = raw_image->data[srcIndex+b];
+        completeExposure(*frame);
+
+        PrimaryCCD.setImageExtension(extension.c_str());
+        PrimaryCCD.setFrameBuffer(buffer);
+        PrimaryCCD.setFrameBufferSize(bufferSize, false);
+
+        if (native) {
+            std::lock_guard<std::mutex> lock(pipelineMutex);
+            if (spareFiles.size() < MAX_QUEUED_FRAMES) {
+                spareFiles.push_back(std::move(frame->fileData));
             }
         }
+        return;
+    }
+
+    if (frame->channels == 1) {
+        PrimaryCCD.setNAxis(2);
+        if (frame->bayerPattern != BayerTP[CFA_TYPE].getText()) {
+            BayerTP[CFA_TYPE].setText(frame->bayerPattern);
+            BayerTP.apply();
+        }
+    } else {
+        PrimaryCCD.setNAxis(3);
     }
 
-    // clear opened buffer
-    LibRaw::dcraw_clear_mem(raw_image);
+    if (!frame->tiles.empty()) {
+        deliverCompressed(*frame);
 
-    // delete image off of camera if set to not save on camera
-    if (SaveOnCameraSP.findOnSwitchIndex() != SAVE_ON_CAMERA) {
-        ret = gp_camera_file_delete(camera, filePath.folder, filePath.name, gpContext);
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (spareBuffers.size() < processingThreadCount) {
+            spareBuffers.push_back(std::move(frame->pixels));
+        }
+        return;
     }
-    
+
+    // the decoded pixels are lent to the chip in place of its frame buffer, so the frame isn't copied again
+    uint8_t *buffer = PrimaryCCD.getFrameBuffer();
+    uint32_t bufferSize = PrimaryCCD.getFrameBufferSize();
+    PrimaryCCD.setFrameBuffer(frame->pixels.data());
+    PrimaryCCD.setFrameBufferSize(frame->pixels.size(), false);
+
     LOG_INFO("Download complete.");
 
+    completeExposure(*frame);
+
+    PrimaryCCD.setFrameBuffer(buffer);
+    PrimaryCCD.setFrameBufferSize(bufferSize, false);
+
+    // keep the pixel buffer around for the frames that are still coming
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    if (spareBuffers.size() < processingThreadCount) {
+        spareBuffers.push_back(std::move(frame->pixels));
+    }
+}
+
+void LumixCameraDriver::completeExposure(const LumixFrame &frame)
+{
+    // INDI sizes the FITS image and fills its header from the chip's subframe, binning, frame type and duration.
+    // The client can change those as soon as the shutter closes, and a half size frame is binned 2x2 further than
+    // the client asked for, so the chip describes this frame while it is handed over and gets the client's values
+    // back afterwards. Only what differs is touched, as every change
+    // is sent to the clients
+    const ExposureSettings &settings = frame.settings;
+    int subX = PrimaryCCD.getSubX(), subY = PrimaryCCD.getSubY(), subW = PrimaryCCD.getSubW(), subH = PrimaryCCD.getSubH();
+    int binX = PrimaryCCD.getBinX(), binY = PrimaryCCD.getBinY();
+    INDI::CCDChip::CCD_FRAME frameType = PrimaryCCD.getFrameType();
+    double duration = PrimaryCCD.getExposureDuration();
+
+    bool frameChanged = subX != settings.subX || subY != settings.subY || subW != settings.subW || subH != settings.subH;
+    bool binChanged = binX != settings.binX || binY != settings.binY;
+    bool durationChanged = duration != settings.duration;
+    if (frameChanged) {
+        PrimaryCCD.setFrame(settings.subX, settings.subY, settings.subW, settings.subH);
+    }
+    if (binChanged) {
+        PrimaryCCD.setBin(settings.binX, settings.binY);
+    }
+    if (durationChanged) {
+        PrimaryCCD.setExposureDuration(settings.duration);
+    }
+    PrimaryCCD.setFrameType(static_cast<INDI::CCDChip::CCD_FRAME>(settings.frameType));
+
+    deliveredSettings = settings;
     ExposureComplete(&PrimaryCCD);
 
-    return 0;
+    PrimaryCCD.setFrameType(frameType);
+    if (durationChanged) {
+        PrimaryCCD.setExposureDuration(duration);
+    }
+    if (binChanged) {
+        PrimaryCCD.setBin(binX, binY);
+    }
+    if (frameChanged) {
+        PrimaryCCD.setFrame(subX, subY, subW, subH);
+    }
+}
+
+void LumixCameraDriver::compressFrame(LumixFrame &frame)
+{
+    auto started = std::chrono::steady_clock::now();
+    frame.tiles = gzipTiles(frame.pixels.data(), frame.width, frame.height, frame.channels, frame.bpp,
+                            COMPRESS_TILE_ROWS, COMPRESS_LEVEL);
+    frame.compressSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    if (std::any_of(frame.tiles.begin(), frame.tiles.end(), [](const std::vector<uint8_t> &tile) { return tile.empty(); })) {
+        LOG_WARN("Compressing the frame failed, it is sent uncompressed.");
+        frame.tiles.clear();
+    }
+}
+
+void LumixCameraDriver::deliverCompressed(LumixFrame &frame)
+{
+    // the image as a binary table of gzipped tiles (the FITS tiled image convention), with the keywords
+    // INDI would have written for it, except the ones describing its layout
+    std::string cards;
+    std::vector<INDI::FITSRecord> records;
+    addFITSKeywords(&PrimaryCCD, records);
+    static const std::set<std::string> structural = {"SIMPLE", "BITPIX", "NAXIS", "NAXIS1", "NAXIS2", "NAXIS3",
+                                                     "EXTEND", "BZERO", "BSCALE", "END"};
+    for (const INDI::FITSRecord &record : records) {
+        if (structural.count(record.key())) {
+            continue;
+        }
+        switch (record.type()) {
+        case INDI::FITSRecord::STRING:
+            appendFitsCard(cards, record.key(), fitsString(record.valueString()), record.comment());
+            break;
+        case INDI::FITSRecord::LONGLONG:
+            appendFitsCard(cards, record.key(), std::to_string(record.valueInt()), record.comment());
+            break;
+        case INDI::FITSRecord::DOUBLE: {
+            char value[32];
+            snprintf(value, sizeof(value), "%.*G", std::max(1, record.decimal()), record.valueDouble());
+            appendFitsCard(cards, record.key(), value, record.comment());
+            break;
+        }
+        case INDI::FITSRecord::COMMENT:
+            appendFitsCard(cards, "COMMENT", "", record.comment());
+            break;
+        default:
+            appendFitsCard(cards, record.key(), "", record.comment());
+        }
+    }
+    std::vector<uint8_t> file = tiledFits(frame.tiles, frame.width, frame.height, frame.channels, frame.bpp,
+                                          COMPRESS_TILE_ROWS, cards);
+
+    double ratio = static_cast<double>(frame.pixels.size()) / file.size();
+    double throughput = frame.compressSeconds > 0 ? frame.pixels.size() / frame.compressSeconds / 1e6 : 0;
+    LOGF_INFO("Compressed the frame from %.1f to %.1f MB (%.2fx) at %.0f MB/s.", frame.pixels.size() / 1e6, file.size() / 1e6, ratio, throughput);
+    TileCompressionNP[COMPRESSION_RATIO].setValue(ratio);
+    TileCompressionNP[COMPRESSION_THROUGHPUT].setValue(throughput);
+    TileCompressionNP.setState(IPS_OK);
+    TileCompressionNP.apply();
+
+    // the file is lent to the chip in place of its frame buffer, like the other finished files
+    std::string extension = PrimaryCCD.getImageExtension();
+    uint8_t *buffer = PrimaryCCD.getFrameBuffer();
+    uint32_t bufferSize = PrimaryCCD.getFrameBufferSize();
+    PrimaryCCD.setImageExtension("fits.fz");
+    PrimaryCCD.setFrameBuffer(file.data());
+    PrimaryCCD.setFrameBufferSize(file.size(), false);
+
+    LOG_INFO("Download complete.");
+    completeExposure(frame);
+
+    PrimaryCCD.setImageExtension(extension.c_str());
+    PrimaryCCD.setFrameBuffer(buffer);
+    PrimaryCCD.setFrameBufferSize(bufferSize, false);
+}
+
+void LumixCameraDriver::sendRawFollowUp()
+{
+    sendQueuedFile(rawFollowUps, RawFrameBP, "of the quick look");
+}
+
+void LumixCameraDriver::sendCameraShot()
+{
+    sendQueuedFile(cameraShots, CameraShotBP, "taken on the camera");
+}
+
+void LumixCameraDriver::sendQueuedFile(std::deque<std::pair<std::string, std::vector<char>>> &files,
+                                       INDI::PropertyBlob &property, const char *what)
+{
+    std::pair<std::string, std::vector<char>> file;
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (files.empty()) {
+            return;
+        }
+        file = std::move(files.front());
+        files.pop_front();
+    }
+
+    LOGF_INFO("Uploading the raw file %s (%.1f MB) %s.", file.first.c_str(), file.second.size() / 1e6, what);
+    property[0].setBlob(file.second.data());
+    property[0].setBlobLen(file.second.size());
+    property[0].setSize(file.second.size());
+    property[0].setFormat(".rw2");
+    property.setState(IPS_OK);
+    property.apply();
+    property[0].setBlob(nullptr);
+
+    std::lock_guard<std::mutex> lock(pipelineMutex);
+    if (spareFiles.size() < MAX_QUEUED_FRAMES) {
+        spareFiles.push_back(std::move(file.second));
+    }
+}
+
+void LumixCameraDriver::updateBurstProgress()
+{
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (!burstChanged) {
+            return;
+        }
+        burstChanged = false;
+
+        BurstProgressNP[BURST_CAPTURED].setValue(burstCaptured);
+        BurstProgressNP[BURST_DOWNLOADED].setValue(burstDownloaded);
+        BurstProgressNP[BURST_PROCESSED].setValue(burstProcessed);
+        BurstProgressNP.setState(awaitedFrames.empty() ? IPS_OK : IPS_BUSY);
+    }
+
+    BurstProgressNP.apply();
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////
@@ -904,23 +4175,53 @@ void LumixCameraDriver::TimerHit()
     // Are we in exposure? Let's check if we're done!
     if (InExposure)
     {
-        // Seconds elapsed
-        double timeLeft = ExposureRequest - m_ElapsedTimer.elapsed() / 1000.0;
-        if (timeLeft <= 0 && !isExposing)
+        double timeLeft = ExposureRequest;
+        bool captured;
+        {
+            std::lock_guard<std::mutex> lock(pipelineMutex);
+            captured = lastCapturedId >= exposureId;
+            // Seconds elapsed since the camera actually started this exposure
+            if (capturingId == exposureId) {
+                timeLeft -= std::chrono::duration<double>(std::chrono::steady_clock::now() - capturingStarted).count();
+            } else if (capturingId >= burstFirstId && capturingId < exposureId) {
+                // the frames of the burst that are still to come count too
+                timeLeft = ExposureRequest * (exposureId - capturingId + 1) -
+                           std::chrono::duration<double>(std::chrono::steady_clock::now() - capturingStarted).count();
+            }
+            if (planTotal > planDone && exposureId >= planFirstId) {
+                // a plan counts down the frames it hasn't started yet plus what is left of the current one
+                timeLeft = planQueuedSeconds;
+                if (capturingId >= planFirstId) {
+                    timeLeft += lastSettings.duration -
+                                std::chrono::duration<double>(std::chrono::steady_clock::now() - capturingStarted).count();
+                }
+            }
+        }
+
+        if (captured)
         {
             /* We're done exposing */
             LOG_INFO("Exposure done, downloading image...");
 
             PrimaryCCD.setExposureLeft(0);
             InExposure = false;
-            // Download Image
-            downloadImage();
         }
         else
             // set the remaining exposure time (make sure it's not negative)
             PrimaryCCD.setExposureLeft(std::max(0.0, timeLeft));
     }
 
+    // hand any finished frames to the client, and the raw files of quick looks after them
+    deliverFrames();
+    sendRawFollowUp();
+    sendCameraShot();
+
+    updateBurstProgress();
+    updateCameraQueue();
+    checkWatchdog();
+    updateSensorGeometry();
+    updateCameraPort();
+
     // TODO: use this syntax to handle ISO, shutter speed, and aperture
     // switch (TemperatureNP.s)
     // {
@@ -988,8 +4289,9 @@ void LumixCameraDriver::addFITSKeywords(INDI::CCDChip *targetChip, std::vector<I
 
     fitsKeywords.push_back({"INPUTFMT", "RW2", "Format of file from which image was read"});
 
-    int actual_iso;
-    if (getIso(&actual_iso)) {
-        fitsKeywords.push_back({"ISOSPEED", std::to_string(actual_iso).c_str(), "ISO camera setting"});
+    // the iso the frame was taken with, as the camera snapped it
+    std::string iso;
+    if (deliveredSettings.iso > 0 && getIsoChoiceValue(deliveredSettings.iso, iso)) {
+        fitsKeywords.push_back({"ISOSPEED", iso.c_str(), "ISO camera setting"});
     }
 }
@@ -1,11 +1,107 @@
 #pragma once
 
 #include <libindi/indiccd.h>
-#include <indielapsedtimer.h>
 #include <gphoto2/gphoto2-camera.h>
 #include <libraw/libraw.h>
 #include <unistd.h>
+#include <algorithm>
 #include <map>
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+// the settings an exposure was requested with, used to check whether a pipelined frame can be reused
+struct ExposureSettings
+{
+    float duration = 0;
+    int iso = 0;
+    int frameType = 0;
+    int subX = 0, subY = 0, subW = 0, subH = 0;
+    int binX = 1, binY = 1;
+    int channels = 0;
+    int bpp = 0;
+    // skip demosaicing and output the sensor's CFA data
+    bool rawBayer = false;
+    // add up binned pixels instead of averaging them
+    bool binSum = false;
+    // bin by collapsing the mosaic into RGB pixels instead of demosaicing
+    bool superpixel = false;
+    // how much work goes into turning the raw file into a frame (a FrameQuality value)
+    int quality = 0;
+    // upload the raw file too when the frame itself is only a quick look
+    bool rawFollowUp = false;
+    // scale the colours of linear frames by the camera's white balance
+    bool whiteBalance = false;
+    // demosaic linear frames with VNG instead of bilinear interpolation
+    bool vng = false;
+    // send the raw file as it came off the camera instead of a decoded frame
+    bool native = false;
+    // upload the frame as a tile compressed FITS file
+    bool compress = false;
+
+    bool operator==(const ExposureSettings &other) const
+    {
+        return duration == other.duration && iso == other.iso && frameType == other.frameType &&
+               subX == other.subX && subY == other.subY && subW == other.subW && subH == other.subH &&
+               binX == other.binX && binY == other.binY && channels == other.channels && bpp == other.bpp &&
+               rawBayer == other.rawBayer && binSum == other.binSum && superpixel == other.superpixel &&
+               quality == other.quality && rawFollowUp == other.rawFollowUp && whiteBalance == other.whiteBalance &&
+               vng == other.vng && native == other.native && compress == other.compress;
+    }
+};
+
+// what a download has made available to a reader: the file's buffer, its size (where it ends when the
+// download stopped early) and how much of it has arrived
+struct DownloadView
+{
+    const char *data = nullptr;
+    size_t size = 0;
+    size_t available = 0;
+};
+
+// a single frame moving through the capture -> processing -> delivery pipeline
+struct LumixFrame
+{
+    uint64_t id = 0;
+    ExposureSettings settings;
+    CameraFilePath path;
+    // raw file contents as downloaded from the camera. The capture thread only (re)allocates it before
+    // any of it has arrived, the processing threads only look at it once fileSize is set
+    std::vector<char> fileData;
+    // size of the file once it is known, the bytes of fileData that have arrived, and whether the download
+    // is still running (guarded by the pipeline mutex)
+    size_t fileSize = 0;
+    size_t received = 0;
+    bool downloading = false;
+    // decoded pixels in the INDI planar (rrr...ggg...bbb...) layout, or a whole image file when format is set
+    std::vector<uint8_t> pixels;
+    std::string format;
+    // set once the processing thread has what it needs from the file, the rest isn't downloaded then
+    bool downloadDone = false;
+    // the gzipped tiles of a compressed frame, and how long compressing them took
+    std::vector<std::vector<uint8_t>> tiles;
+    double compressSeconds = 0;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int bpp = 0;
+    // CFA pattern at the frame origin when the frame is raw Bayer data
+    std::string bayerPattern;
+    bool failed = false;
+    // part of a burst, which is exposed back to back before any of it is downloaded
+    bool burst = false;
+    // part of an exposure plan the driver runs on its own
+    bool planned = false;
+    // exposed ahead of the client, its file doesn't stay on the card unless the client claims the frame
+    bool speculative = false;
+};
 
 class LumixCameraDriver : public INDI::CCD
 {
@@ -20,6 +116,8 @@ public:
 
     bool StartExposure(float duration) override;
     bool AbortExposure() override;
+    bool StartStreaming() override;
+    bool StopStreaming() override;
 
 protected:
     virtual bool initProperties() override;
@@ -29,6 +127,7 @@ protected:
     void addFITSKeywords(INDI::CCDChip *targetChip, std::vector<INDI::FITSRecord> &fitsKeywords) override;
 
     void TimerHit() override;
+    bool saveConfigItems(FILE *fp) override;
     //virtual bool ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) override;
     //virtual bool ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n) override;
     virtual bool UpdateCCDFrame(int x, int y, int w, int h) override;
@@ -39,23 +138,79 @@ private:
     // variables for dealing with gphoto2
     Camera *camera;
     GPContext *gpContext;
+    // loaded once, they tell gphoto which driver and port to use instead of it probing all of them.
+    // Shared with the port probes, which can outlive a connect attempt and the driver
+    std::shared_ptr<CameraAbilitiesList> abilitiesList;
+    std::shared_ptr<GPPortInfoList> portList;
+    // the port and model the camera was last found on (guarded by the pipeline mutex, the capture thread reconnects)
+    std::string cameraPort;
+    std::string cameraModel;
+    bool cameraPortChanged = false;
     // stores the latest file path details of the most recent photo
     CameraFilePath filePath;
-    // stores camera widgets (basically settings)
-    CameraWidget *config;
-    CameraWidget *iso_w;
-    CameraWidget *ss; // shutter speed
+    // stores camera widgets (basically settings), config is null when the widgets were read on their own
+    CameraWidget *config = nullptr;
+    CameraWidget *iso_w = nullptr;
+    CameraWidget *ss = nullptr; // shutter speed
+    // opens and closes the shutter in bulb mode (null when the camera has no bulb control)
+    CameraWidget *bulb_w = nullptr;
     // camera setting possible choices
-    std::map<float, const char*> ss_choices;
-    std::map<int, const char*> iso_choices;
+    std::map<float, std::string> ss_choices;
+    // the shutter speed choice that puts the camera in bulb mode
+    std::string bulbChoice;
+    // the iso choices are also read by the main thread, so they are changed under choicesMutex
+    std::map<int, std::string> iso_choices;
+    std::mutex choicesMutex;
+    // manufacturer, model, serial and version as read from the camera, shown in CameraInfoTP
+    std::string cameraInfo[4];
+    // sensor size learned from the first decoded frame (0 until then), guarded by the pipeline mutex
+    int sensorWidth = 0;
+    int sensorHeight = 0;
+    bool sensorChanged = false;
+    // the choice tables, camera info and sensor size are kept in a file per camera, so connecting
+    // to a known camera doesn't have to read and parse its whole configuration
+    std::string capabilityCache;
+    bool capabilitiesCached = false;
+    // files to delete from the camera once it has time for it (capture thread only). They are also listed
+    // in a journal next to the capability cache, so files a crashed session left behind get deleted on
+    // the next connect, and only those.
+    std::deque<CameraFilePath> pendingDeletes;
+    std::string deleteJournal;
 
     // functions for dealing with gphoto2
     GPContext* create_context();
+    Camera *probeCameraPorts(std::string &port, std::string &model);
+    void updateCameraPort();
+    bool open_camera();
     bool connect_to_lumix_camera();
     bool load_camera_widgets();
     bool load_camera_info();
+    void freeCameraWidgets();
+    void readCameraInfo(CameraWidget *tree, std::string info[4]);
+    void readShutterChoices(CameraWidget *widget, std::map<float, std::string> &choices);
+    void readIsoChoices(CameraWidget *widget, std::map<int, std::string> &choices);
+    std::string capabilityCachePath();
+    bool loadCapabilityCache(const std::string &path);
+    void saveCapabilityCache();
+    void revalidateCapabilities();
+    void noteSensorSize(int width, int height);
+    void updateSensorGeometry();
     void error_func(GPContext *context, const char *str, void *data);
     void status_func(GPContext *context, const char *str, void *data);
+    // makes gphoto give up on the operation in progress once an abort was requested
+    static GPContextFeedback cancel_func(GPContext *context, void *data);
+
+    // camera settings are changed on the widgets first and pushed to the camera together right
+    // before a capture, only the ones that differ from what the camera already has
+    struct ConfigChange
+    {
+        CameraWidget *widget;
+        std::string value;
+    };
+    std::map<std::string, std::string> cameraConfig;
+    std::map<std::string, ConfigChange> pendingConfig;
+    bool setConfigValue(CameraWidget *widget, const char *value);
+    bool applyConfig();
 
     // define Indi properties
     INDI::PropertyNumber IsoNP {1};
@@ -66,20 +221,323 @@ private:
         SERIAL,
         VERSION
     };
+    INDI::PropertyText NativeFrameTP {4};
+    enum {
+        NATIVE_FILE,
+        NATIVE_INSTRUMENT,
+        NATIVE_EXPOSURE,
+        NATIVE_ISO
+    };
+    INDI::PropertyText CameraPortTP {2};
+    enum {
+        PORT,
+        PORT_MODEL
+    };
     INDI::PropertySwitch SaveOnCameraSP {1};
     enum {
         SAVE_ON_CAMERA
     };
+    INDI::PropertySwitch PipelineSP {1};
+    enum {
+        PIPELINE_ENABLED
+    };
+    INDI::PropertyNumber PipelineFramesNP {1};
+    INDI::PropertyNumber ProcessingThreadsNP {1};
+    INDI::PropertyNumber CameraHealthNP {3};
+    enum {
+        STALL_COUNT,
+        RECONNECT_COUNT,
+        RECONNECT_TIME
+    };
+    INDI::PropertyNumber CameraQueueNP {3};
+    enum {
+        QUEUE_DEPTH,
+        COMMAND_WAIT,
+        COMMAND_TIME
+    };
+    INDI::PropertyNumber BurstNP {1};
+    INDI::PropertyNumber BurstProgressNP {3};
+    enum {
+        BURST_CAPTURED,
+        BURST_DOWNLOADED,
+        BURST_PROCESSED
+    };
+    INDI::PropertyText PlanTP {1};
+    INDI::PropertySwitch PlanSP {2};
+    enum {
+        PLAN_START,
+        PLAN_ABORT
+    };
+    INDI::PropertySwitch PlanOrderSP {1};
+    enum {
+        PLAN_GROUP
+    };
+    INDI::PropertyNumber PlanProgressNP {2};
+    enum {
+        PLAN_DONE,
+        PLAN_TOTAL
+    };
+    INDI::PropertySwitch FrameQualitySP {5};
+    enum FrameQuality {
+        QUALITY_FULL,
+        QUALITY_BILINEAR,
+        QUALITY_HALF_SIZE,
+        QUALITY_LINEAR,
+        QUALITY_QUICK_LOOK
+    };
+    INDI::PropertySwitch WhiteBalanceSP {1};
+    enum {
+        WHITE_BALANCE_CAMERA
+    };
+    INDI::PropertySwitch LinearDemosaicSP {2};
+    enum {
+        DEMOSAIC_BILINEAR,
+        DEMOSAIC_VNG
+    };
+    INDI::PropertySwitch TileCompressSP {1};
+    enum {
+        TILE_COMPRESS
+    };
+    INDI::PropertyNumber TileCompressionNP {2};
+    enum {
+        COMPRESSION_RATIO,
+        COMPRESSION_THROUGHPUT
+    };
+    INDI::PropertySwitch RawFollowUpSP {1};
+    enum {
+        RAW_FOLLOW_UP
+    };
+    INDI::PropertyBlob RawFrameBP {1};
+    INDI::PropertySwitch CameraShotsSP {1};
+    enum {
+        CAMERA_SHOTS
+    };
+    INDI::PropertyBlob CameraShotBP {1};
+    INDI::PropertySwitch RawBayerSP {1};
+    enum {
+        RAW_BAYER
+    };
+    INDI::PropertySwitch BinModeSP {3};
+    enum {
+        BIN_AVERAGE,
+        BIN_SUM,
+        BIN_SUPERPIXEL
+    };
 
-    INDI::ElapsedTimer m_ElapsedTimer;
     double ExposureRequest;
-    bool isExposing = false;
+    // id of the frame the current client exposure is waiting on
+    uint64_t exposureId = 0;
+
+    // capture pipeline: the capture thread owns the camera while exposing and downloading,
+    // a pool of processing threads decodes, and TimerHit delivers finished frames to the client
+    static constexpr size_t MAX_QUEUED_FRAMES = 2;
+    // files are read from the camera in chunks of this size, so decoding can start before they are complete
+    static constexpr uint64_t DOWNLOAD_CHUNK_SIZE = 4 * 1024 * 1024;
+    // exposures at least this long that have no exact shutter speed are timed by the driver in bulb mode
+    static constexpr float BULB_MIN_DURATION = 1;
+    // how long the camera gets to write the file once the exposure is over
+    static constexpr int FILE_TIMEOUT_MS = 30000;
+    // how long to wait for the raw file after another one (the JPEG of RAW+JPEG) showed up
+    static constexpr int RAW_FILE_FOLLOW_MS = 3000;
+    // how long cameras found by autodetection get to answer before the ones that did are used
+    static constexpr int PORT_PROBE_TIMEOUT_MS = 10000;
+    // first line of the capability cache files, changed when their format changes
+    static constexpr const char *CAPABILITY_CACHE_HEADER = "indi_lumix capabilities 1";
+    // assumed until the first frame tells the real sensor size
+    static constexpr int DEFAULT_SENSOR_WIDTH = 6008;
+    static constexpr int DEFAULT_SENSOR_HEIGHT = 4008;
+    // how long camera operations may take before the watchdog considers the camera stalled
+    // (exposures get their duration on top)
+    static constexpr double CAPTURE_DEADLINE = 90;
+    static constexpr double DOWNLOAD_DEADLINE = 120;
+    static constexpr double COMMAND_DEADLINE = 30;
+    // how often a frame is retried after the camera had to be reconnected
+    static constexpr int MAX_FRAME_RETRIES = 2;
+    // pause between attempts to reconnect a stalled camera
+    static constexpr int RECONNECT_RETRY_MS = 2000;
+    // how many queued files are deleted from the camera at a time while it is idle
+    static constexpr size_t DELETE_BATCH = 4;
+    // deleting files stops this long before the shutter of a bulb exposure has to close
+    static constexpr int DELETE_MARGIN_MS = 2000;
+    // live view is retried this often while the camera doesn't deliver previews
+    static constexpr int PREVIEW_RETRY_MS = 1000;
+    // compressed frames are cut into tiles of this many rows, and gzipped at this level
+    static constexpr int COMPRESS_TILE_ROWS = 16;
+    static constexpr int COMPRESS_LEVEL = 1;
+    // camera events are waited for in steps of this, so aborts and new requests are noticed in between
+    static constexpr int CAMERA_EVENT_WAIT_MS = 100;
+    // how often the idle capture thread checks the camera for shots taken with its shutter button
+    static constexpr int CAMERA_IDLE_POLL_MS = 250;
+    std::thread captureThread;
+    std::vector<std::thread> processingThreads;
+    size_t processingThreadCount = 1;
+    std::mutex pipelineMutex;
+    std::condition_variable pipelineCondition;
+    bool pipelineRunning = false;
+    std::atomic<bool> pipelineEnabled {false};
+    uint64_t nextFrameId = 1;
+    // the next client exposure waiting for the capture thread
+    std::unique_ptr<LumixFrame> captureRequest;
+    // frame ids the client is waiting on, in the order they were requested
+    std::deque<uint64_t> awaitedFrames;
+    // the frame being exposed right now (0 when idle) and when its exposure started
+    uint64_t capturingId = 0;
+    std::chrono::steady_clock::time_point capturingStarted;
+    uint64_t lastCapturedId = 0;
+    // a frame exposed ahead of the client's request, and the settings it was taken with
+    uint64_t speculativeId = 0;
+    ExposureSettings speculativeSettings;
+    bool speculateNext = false;
+    // the file of the frame exposed ahead once it is downloaded, deleted when the frame is dropped
+    CameraFilePath speculativePath {};
+    // how many more exposures the client said it will ask for, frames are only exposed ahead while some are
+    int framesToCome = 0;
+    ExposureSettings lastSettings;
+    // frames of the current burst still to be exposed and the id of the next one, and its progress
+    int burstLeft = 0;
+    uint64_t burstFirstId = 0;
+    uint64_t burstNextId = 0;
+    int burstCaptured = 0;
+    int burstDownloaded = 0;
+    int burstProcessed = 0;
+    bool burstChanged = false;
+    // frames of the running exposure plan that are still to be exposed, with the ids they are awaited as,
+    // and the time they will take
+    std::deque<std::pair<uint64_t, ExposureSettings>> planQueue;
+    double planQueuedSeconds = 0;
+    uint64_t planFirstId = 0;
+    // frames of the plan handed to the client (main thread only)
+    int planDone = 0;
+    int planTotal = 0;
+    // live view: the capture thread takes a preview when it has nothing else to do and the next one is due,
+    // the counters are for the log
+    bool streaming = false;
+    std::chrono::steady_clock::time_point nextPreview;
+    uint64_t previewFrames = 0;
+    uint64_t previewDropped = 0;
+    // the size last given to the streamer, and the file previews are read into (capture thread only)
+    int previewWidth = 0;
+    int previewHeight = 0;
+    bool previewFailing = false;
+    CameraFile *previewFile = nullptr;
+    // burst frames that are on the camera card waiting to be downloaded (capture thread only)
+    std::deque<std::unique_ptr<LumixFrame>> burstDownloads;
+    // the settings of the frame last handed to the client, for its FITS header
+    ExposureSettings deliveredSettings;
+    // the capture thread is the only one talking to the camera, other threads queue commands for it.
+    // Lower priorities run first, captures go right after aborts and before everything else.
+    enum CommandPriority {
+        COMMAND_ABORT,
+        COMMAND_CAPTURE,
+        COMMAND_CONFIG,
+        COMMAND_INFO
+    };
+    struct CameraCommand
+    {
+        const char *name;
+        std::function<void()> run;
+        std::chrono::steady_clock::time_point queued;
+    };
+    std::multimap<CommandPriority, CameraCommand> cameraCommands;
+    // how long the last command waited in the queue and took to run, for CameraQueueNP
+    double commandWait = 0;
+    double commandTime = 0;
+    bool commandStatsChanged = false;
+    // the switch properties can change under the capture thread, so it reads this copy
+    std::atomic<bool> saveOnCamera {false};
+    std::atomic<bool> sendCameraShots {false};
+    // the camera operation the watchdog is timing (null when idle), and when it has to be done by
+    const char *cameraOperation = nullptr;
+    std::chrono::steady_clock::time_point operationDeadline;
+    // set when the camera stopped responding, the capture thread reconnects it
+    bool stalled = false;
+    int stallCount = 0;
+    int reconnectCount = 0;
+    double reconnectTime = 0;
+    bool healthChanged = false;
+    // set by AbortExposure to cancel the camera operation in progress, cleared by the capture thread
+    // once the camera is idle again
+    std::atomic<bool> cancelIo {false};
+    // set while the bulb shutter is being closed, which has to happen even when cancelling
+    std::atomic<bool> closingShutter {false};
+    bool aborting = false;
+    // exposures aborted after the camera was triggered, their files may still show up (capture thread only)
+    int abortedCaptures = 0;
+    // how many of those were exposed ahead of the client, their files are deleted even when photos are kept
+    int abortedSpeculations = 0;
+    std::chrono::steady_clock::time_point abortStarted;
+    // the decoders of the processing threads and the frame each of them is working on
+    std::map<LibRaw *, uint64_t> decoding;
+    std::deque<std::unique_ptr<LumixFrame>> processingQueue;
+    std::deque<std::unique_ptr<LumixFrame>> completedFrames;
+    // pixel buffers of delivered frames, handed to the next frames so decoding doesn't allocate every exposure
+    std::vector<std::vector<uint8_t>> spareBuffers;
+    // same for the buffers raw files are downloaded into
+    std::vector<std::vector<char>> spareFiles;
+    // raw files of quick look frames waiting to be uploaded after them
+    std::deque<std::pair<std::string, std::vector<char>>> rawFollowUps;
+    // raw files of shots taken with the camera's own shutter button, waiting to be uploaded
+    std::deque<std::pair<std::string, std::vector<char>>> cameraShots;
+
+    void startPipeline();
+    void stopPipeline();
+    void captureLoop();
+    void processingLoop(size_t index);
+    void setProcessingThreads(size_t count);
+    bool isAwaited(uint64_t id) const;
+    void queueCameraCommand(CommandPriority priority, const char *name, std::function<void()> run);
+    bool runCameraCommand(std::unique_lock<std::mutex> &lock, CommandPriority lowest);
+    bool pollCameraFiles(std::unique_lock<std::mutex> &lock);
+    void updateCameraQueue();
+    void watchOperation(const char *name, double seconds = 0);
+    void reportStall(const char *reason);
+    void checkWatchdog();
+    bool recoverFromStall();
+    bool reconnectCamera();
+    bool stageExposureSettings(const ExposureSettings &settings);
+    void finishAbort();
+    ExposureSettings currentExposureSettings(float duration);
+    bool captureImage(LumixFrame &frame);
+    bool useBulb(float duration);
+    bool setBulb(bool open);
+    bool bulbCapture(LumixFrame &frame);
+    int nextFileAdded(CameraFilePath *path, int timeout);
+    bool waitForFile(LumixFrame &frame, int timeout, std::chrono::steady_clock::time_point busyUntil = {});
+    void queueDelete(const CameraFilePath &path);
+    void deletePendingFiles(std::chrono::steady_clock::time_point until, size_t limit);
+    void loadDeleteJournal();
+    void writeDeleteJournal();
+    bool passOnFrame(std::unique_ptr<LumixFrame> frame, bool captured);
+    void deliverFrames();
+    void dropSpeculation();
+    void completeExposure(const LumixFrame &frame);
+    void updateBurstProgress();
+    bool startPlan(const std::string &text);
+    void prefetchSettings();
+    void capturePreview();
+    bool downloadBurst();
 
-    int downloadImage();
+    int downloadImage(LumixFrame &frame);
+    int streamFile(LumixFrame &frame);
+    DownloadView waitForDownload(LumixFrame &frame, size_t bytes);
+    bool waitForWholeFile(LumixFrame &frame);
+    int processImage(LibRaw &raw_processor, LumixFrame &frame);
+    int processMosaic(LibRaw &raw_processor, LumixFrame &frame);
+    int processLinear(LibRaw &raw_processor, LumixFrame &frame);
+    void developHalfSize(LibRaw &raw_processor, uint16_t *planes, size_t planeSize);
+    bool processQuickLook(LibRaw &raw_processor, LumixFrame &frame);
+    void sendRawFollowUp();
+    void sendCameraShot();
+    void sendQueuedFile(std::deque<std::pair<std::string, std::vector<char>>> &files, INDI::PropertyBlob &property,
+                        const char *what);
+    void compressFrame(LumixFrame &frame);
+    void deliverCompressed(LumixFrame &frame);
+    bool isSuperpixelBinning();
+    int getOutputChannels();
+    int getOutputScale();
     bool setupParams();
-    bool getExposureValue(float duration, const char **value);
+    bool getExposureValue(float duration, std::string &value);
     bool setShutterSpeed(float duration);
-    bool getIsoChoiceValue(int iso, const char **value);
+    bool getIsoChoiceValue(int iso, std::string &value);
     bool setIso(int iso);
-    bool getIso(int *iso);
 };
\ No newline at end of file
@@ -0,0 +1,925 @@
+#include "lumix_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+// LUMIX_IMAGE_NO_SIMD builds the plain loops only, the tests compare both builds against each other
+#if defined(LUMIX_IMAGE_NO_SIMD)
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LUMIX_IMAGE_NEON 1
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define LUMIX_IMAGE_SSSE3 1
+#endif
+
+void parallelRows(int height, const std::function<void(int, int)> &fn, int minRowsPerBand)
+{
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, std::max(1, height / std::max(1, minRowsPerBand)));
+    if (threads <= 1) {
+        fn(0, height);
+        return;
+    }
+
+    int band = (height + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (int first = band; first < height; first += band) {
+        int end = std::min(height, first + band);
+        workers.emplace_back([&fn, first, end] { fn(first, end); });
+    }
+
+    // the calling thread takes the first band itself
+    fn(0, std::min(height, band));
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+#pragma region Deinterleave
+
+#if defined(LUMIX_IMAGE_SSSE3)
+// pshufb masks that move the elements of one channel found in each of three 16 byte source blocks
+// into their place in a 16 byte plane block (mask[channel][block])
+struct DeinterleaveMasks
+{
+    __m128i mask[3][3];
+};
+
+static DeinterleaveMasks makeDeinterleaveMasks(int elementSize)
+{
+    DeinterleaveMasks masks;
+    int elements = 16 / elementSize;
+
+    for (int c = 0; c < 3; c++) {
+        for (int block = 0; block < 3; block++) {
+            alignas(16) int8_t bytes[16];
+            for (int i = 0; i < elements; i++) {
+                // where element i of this channel's plane block lives inside the source block
+                int source = i * 3 + c - block * elements;
+                for (int b = 0; b < elementSize; b++) {
+                    bytes[i * elementSize + b] = (source >= 0 && source < elements) ? source * elementSize + b : -128;
+                }
+            }
+            masks.mask[c][block] = _mm_load_si128(reinterpret_cast<const __m128i *>(bytes));
+        }
+    }
+
+    return masks;
+}
+
+// deinterleaves 3 channels working on bytes, returns how many bytes of each plane were written
+__attribute__((target("ssse3")))
+static size_t deinterleave3SSSE3(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t planeBytes, const DeinterleaveMasks &masks)
+{
+    uint8_t *planes[3] = {r, g, b};
+
+    size_t i = 0;
+    for (; i + 16 <= planeBytes; i += 16) {
+        const uint8_t *block = src + i * 3;
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16));
+        __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 32));
+
+        for (int c = 0; c < 3; c++) {
+            __m128i plane = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(b0, masks.mask[c][0]), _mm_shuffle_epi8(b1, masks.mask[c][1])),
+                _mm_shuffle_epi8(b2, masks.mask[c][2]));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(planes[c] + i), plane);
+        }
+    }
+
+    return i;
+}
+
+template <typename T>
+static size_t deinterleave3Simd(const T *src, T *r, T *g, T *b, size_t count)
+{
+    static const bool supported = __builtin_cpu_supports("ssse3");
+    static const DeinterleaveMasks masks = makeDeinterleaveMasks(sizeof(T));
+    if (!supported) {
+        return 0;
+    }
+
+    size_t bytes = deinterleave3SSSE3(reinterpret_cast<const uint8_t *>(src), reinterpret_cast<uint8_t *>(r),
+                                      reinterpret_cast<uint8_t *>(g), reinterpret_cast<uint8_t *>(b),
+                                      count * sizeof(T), masks);
+    return bytes / sizeof(T);
+}
+#elif defined(LUMIX_IMAGE_NEON)
+static size_t deinterleave3Simd(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x3_t pixels = vld3q_u8(src + i * 3);
+        vst1q_u8(r + i, pixels.val[0]);
+        vst1q_u8(g + i, pixels.val[1]);
+        vst1q_u8(b + i, pixels.val[2]);
+    }
+    return i;
+}
+
+static size_t deinterleave3Simd(const uint16_t *src, uint16_t *r, uint16_t *g, uint16_t *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint16x8x3_t pixels = vld3q_u16(src + i * 3);
+        vst1q_u16(r + i, pixels.val[0]);
+        vst1q_u16(g + i, pixels.val[1]);
+        vst1q_u16(b + i, pixels.val[2]);
+    }
+    return i;
+}
+#else
+template <typename T>
+static size_t deinterleave3Simd(const T *, T *, T *, T *, size_t)
+{
+    return 0;
+}
+#endif
+
+// deinterleaves count pixels starting at src into planes that are planeSize pixels apart
+template <typename T>
+static void deinterleaveRange(const T *src, T *dst, size_t count, size_t planeSize, int channels)
+{
+    if (channels == 3) {
+        T *r = dst;
+        T *g = dst + planeSize;
+        T *b = dst + planeSize * 2;
+
+        size_t i = deinterleave3Simd(src, r, g, b, count);
+        for (; i < count; i++) {
+            r[i] = src[i * 3];
+            g[i] = src[i * 3 + 1];
+            b[i] = src[i * 3 + 2];
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        for (int c = 0; c < channels; c++) {
+            dst[c * planeSize + i] = src[i * channels + c];
+        }
+    }
+}
+
+template <typename T>
+static void deinterleave(const T *src, int srcStride, T *dst, int width, int height, int channels)
+{
+    size_t planeSize = static_cast<size_t>(width) * height;
+    parallelRows(height, [&](int firstRow, int endRow) {
+        // whole images are contiguous, windows have to go row by row
+        if (srcStride == width) {
+            size_t first = static_cast<size_t>(firstRow) * width;
+            deinterleaveRange(src + first * channels, dst + first, static_cast<size_t>(endRow - firstRow) * width, planeSize, channels);
+            return;
+        }
+
+        for (int row = firstRow; row < endRow; row++) {
+            deinterleaveRange(src + static_cast<size_t>(row) * srcStride * channels, dst + static_cast<size_t>(row) * width, width, planeSize, channels);
+        }
+    });
+}
+
+void deinterleave8(const uint8_t *src, int srcStride, uint8_t *dst, int width, int height, int channels)
+{
+    deinterleave(src, srcStride, dst, width, height, channels);
+}
+
+void deinterleave16(const uint16_t *src, int srcStride, uint16_t *dst, int width, int height, int channels)
+{
+    deinterleave(src, srcStride, dst, width, height, channels);
+}
+
+#pragma endregion Deinterleave
+
+#pragma region Binning
+
+static inline uint16_t combineSamples(uint64_t total, uint32_t samples, uint32_t fullSamples, bool sum)
+{
+    if (samples == 0) {
+        return 0;
+    }
+    if (sum) {
+        // scale partial blocks at the edges as if they were full
+        return std::min<uint64_t>(total * fullSamples / samples, 0xffff);
+    }
+    return (total + samples / 2) / samples;
+}
+
+void binInterleaved16(const uint16_t *src, int srcStride, int width, int height, int channels, int binX, int binY, bool sum, uint16_t *dst)
+{
+    int outWidth  = width / binX;
+    int outHeight = height / binY;
+    size_t planeSize = static_cast<size_t>(outWidth) * outHeight;
+    uint32_t samples = binX * binY;
+
+    parallelRows(outHeight, [&](int firstRow, int endRow) {
+        std::vector<uint32_t> acc(static_cast<size_t>(outWidth) * binX * channels);
+        for (int oy = firstRow; oy < endRow; oy++) {
+            // add up the source rows of this output row first, this loop vectorizes
+            std::fill(acc.begin(), acc.end(), 0);
+            for (int j = 0; j < binY; j++) {
+                const uint16_t *row = src + (static_cast<size_t>(oy) * binY + j) * srcStride * channels;
+                for (size_t i = 0; i < acc.size(); i++) {
+                    acc[i] += row[i];
+                }
+            }
+
+            // then combine neighbouring columns of each channel into its plane
+            for (int c = 0; c < channels; c++) {
+                uint16_t *out = dst + c * planeSize + static_cast<size_t>(oy) * outWidth;
+                for (int ox = 0; ox < outWidth; ox++) {
+                    uint64_t total = 0;
+                    for (int i = 0; i < binX; i++) {
+                        total += acc[(static_cast<size_t>(ox) * binX + i) * channels + c];
+                    }
+                    out[ox] = combineSamples(total, samples, samples, sum);
+                }
+            }
+        }
+    }, 16);
+}
+
+void binBayer16(const uint16_t *src, int srcStride, int width, int height, int binX, int binY, bool sum, uint16_t *dst)
+{
+    int outWidth  = width / binX;
+    int outHeight = height / binY;
+    uint32_t fullSamples = binX * binY;
+
+    parallelRows(outHeight, [&](int firstRow, int endRow) {
+        std::vector<uint32_t> acc(width);
+        for (int oy = firstRow; oy < endRow; oy++) {
+            // an output 2x2 cell covers 2*binX x 2*binY source pixels, same coloured samples are 2 apart
+            int firstSource = (oy >> 1) * 2 * binY + (oy & 1);
+            int rows = 0;
+
+            std::fill(acc.begin(), acc.end(), 0);
+            for (int j = 0; j < binY; j++) {
+                int sourceRow = firstSource + 2 * j;
+                if (sourceRow >= height) {
+                    break;
+                }
+                const uint16_t *row = src + static_cast<size_t>(sourceRow) * srcStride;
+                for (int i = 0; i < width; i++) {
+                    acc[i] += row[i];
+                }
+                rows++;
+            }
+
+            uint16_t *out = dst + static_cast<size_t>(oy) * outWidth;
+            for (int ox = 0; ox < outWidth; ox++) {
+                int firstColumn = (ox >> 1) * 2 * binX + (ox & 1);
+                uint64_t total = 0;
+                int columns = 0;
+                for (int i = 0; i < binX; i++) {
+                    int column = firstColumn + 2 * i;
+                    if (column >= width) {
+                        break;
+                    }
+                    total += acc[column];
+                    columns++;
+                }
+                out[ox] = combineSamples(total, rows * columns, fullSamples, sum);
+            }
+        }
+    }, 16);
+}
+
+void superpixel16(const uint16_t *src, int srcStride, int width, int height, const int pattern[4], int binX, int binY, uint16_t *dst)
+{
+    int outWidth  = width / binX;
+    int outHeight = height / binY;
+    size_t planeSize = static_cast<size_t>(outWidth) * outHeight;
+
+    // every CFA site appears binX * binY / 4 times in a block
+    uint32_t siteSamples = binX * binY / 4;
+    uint32_t colorSamples[3] = {0, 0, 0};
+    for (int s = 0; s < 4; s++) {
+        colorSamples[pattern[s]] += siteSamples;
+    }
+
+    parallelRows(outHeight, [&](int firstRow, int endRow) {
+        // even and odd source rows are kept apart since they hold different colours
+        std::vector<uint32_t> evenRows(width);
+        std::vector<uint32_t> oddRows(width);
+        for (int oy = firstRow; oy < endRow; oy++) {
+            std::fill(evenRows.begin(), evenRows.end(), 0);
+            std::fill(oddRows.begin(), oddRows.end(), 0);
+            for (int j = 0; j < binY; j += 2) {
+                const uint16_t *even = src + (static_cast<size_t>(oy) * binY + j) * srcStride;
+                const uint16_t *odd  = even + srcStride;
+                for (int i = 0; i < width; i++) {
+                    evenRows[i] += even[i];
+                    oddRows[i]  += odd[i];
+                }
+            }
+
+            size_t outRow = static_cast<size_t>(oy) * outWidth;
+            for (int ox = 0; ox < outWidth; ox++) {
+                uint64_t sites[4] = {0, 0, 0, 0};
+                for (int i = 0; i < binX; i++) {
+                    int column = ox * binX + i;
+                    sites[i & 1]       += evenRows[column];
+                    sites[2 + (i & 1)] += oddRows[column];
+                }
+
+                uint64_t colors[3] = {0, 0, 0};
+                for (int s = 0; s < 4; s++) {
+                    colors[pattern[s]] += sites[s];
+                }
+                for (int c = 0; c < 3; c++) {
+                    dst[c * planeSize + outRow + ox] = combineSamples(colors[c], colorSamples[c], colorSamples[c], false);
+                }
+            }
+        }
+    }, 16);
+}
+
+#pragma endregion Binning
+
+#pragma region Demosaic
+
+// mirrors coordinates past the edges by two pixels, so the mirrored sample has the same colour
+static inline int mirrorEdge(int i, int size)
+{
+    return i < 0 ? -i : i >= size ? 2 * size - 2 - i : i;
+}
+
+void demosaicBilinear16(const uint16_t *src, int srcStride, int imageWidth, int imageHeight, const int pattern[4],
+                        const CfaScale &scale, int x, int y, int width, int height, int binX, int binY, bool sum,
+                        uint16_t *dst)
+{
+    int outWidth  = width / binX;
+    int outHeight = height / binY;
+    size_t planeSize = static_cast<size_t>(outWidth) * outHeight;
+    float divisor = sum ? 1.0f : binX * binY;
+
+    // leftover columns are dropped, so they aren't interpolated either
+    int usedWidth = outWidth * binX;
+    int lineWidth = usedWidth + 2;
+
+    parallelRows(outHeight, [&](int firstRow, int endRow) {
+        // the scaled source rows of this band, three at a time, with a column either side of the window
+        std::vector<float> lines(3 * static_cast<size_t>(lineWidth));
+        int lineRows[3] = {-2, -2, -2};
+        auto scaledLine = [&](int row) -> const float * {
+            int slot = (row + 3) % 3;
+            float *line = lines.data() + slot * static_cast<size_t>(lineWidth);
+            if (lineRows[slot] == row) {
+                return line;
+            }
+            lineRows[slot] = row;
+
+            const uint16_t *in = src + static_cast<size_t>(mirrorEdge(row, imageHeight)) * srcStride;
+            int siteRow = (row & 1) << 1;
+            for (int i = 0; i < lineWidth; i++) {
+                int column = x - 1 + i;
+                if (i == 0 || i == lineWidth - 1) {
+                    column = mirrorEdge(column, imageWidth);
+                }
+                int site = siteRow | (column & 1);
+                line[i] = (in[column] - scale.black[site]) * scale.gain[site];
+            }
+            return line;
+        };
+
+        std::vector<float> acc(3 * static_cast<size_t>(outWidth));
+        for (int oy = firstRow; oy < endRow; oy++) {
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (int j = 0; j < binY; j++) {
+                int row = y + oy * binY + j;
+                const float *up   = scaledLine(row - 1);
+                const float *mid  = scaledLine(row);
+                const float *down = scaledLine(row + 1);
+
+                int siteRow = (row & 1) << 1;
+                for (int i = 0; i < usedWidth; i++) {
+                    int site = siteRow | ((x + i) & 1);
+                    int k = i + 1;
+                    float rgb[3];
+                    float across = (mid[k - 1] + mid[k + 1]) * 0.5f;
+                    float upDown = (up[k] + down[k]) * 0.5f;
+
+                    rgb[pattern[site]] = mid[k];
+                    if (pattern[site ^ 1] == pattern[site ^ 2]) {
+                        // a red or blue site has green all around it and the other colour on the diagonals
+                        rgb[pattern[site ^ 1]] = (across + upDown) * 0.5f;
+                        rgb[pattern[site ^ 3]] = (up[k - 1] + up[k + 1] + down[k - 1] + down[k + 1]) * 0.25f;
+                    } else {
+                        rgb[pattern[site ^ 1]] = across;
+                        rgb[pattern[site ^ 2]] = upDown;
+                    }
+
+                    int ox = i / binX;
+                    acc[ox]                += rgb[0];
+                    acc[outWidth + ox]     += rgb[1];
+                    acc[2 * outWidth + ox] += rgb[2];
+                }
+            }
+
+            for (int c = 0; c < 3; c++) {
+                const float *in = acc.data() + static_cast<size_t>(c) * outWidth;
+                uint16_t *out = dst + c * planeSize + static_cast<size_t>(oy) * outWidth;
+                for (int ox = 0; ox < outWidth; ox++) {
+                    out[ox] = static_cast<uint16_t>(std::min(std::max(in[ox] / divisor + 0.5f, 0.0f), 65535.0f));
+                }
+            }
+        }
+    }, 16);
+}
+
+void demosaicVNG16(const uint16_t *src, int srcStride, int imageWidth, int imageHeight, const int pattern[4],
+                   const CfaScale &scale, int x, int y, int width, int height, int binX, int binY, bool sum,
+                   uint16_t *dst)
+{
+    int outWidth  = width / binX;
+    int outHeight = height / binY;
+    size_t planeSize = static_cast<size_t>(outWidth) * outHeight;
+    float divisor = sum ? 1.0f : binX * binY;
+
+    // the 5x5 neighbourhood reaches two columns past either side of the window
+    int usedWidth = outWidth * binX;
+    int lineWidth = usedWidth + 4;
+
+    // N, NE, E, SE, S, SW, W, NW as row and column steps
+    static const int directions[8][2] = {{-1, 0}, {-1, 1}, {0, 1}, {1, 1}, {1, 0}, {1, -1}, {0, -1}, {-1, -1}};
+
+    parallelRows(outHeight, [&](int firstRow, int endRow) {
+        // the scaled source rows of this band, five at a time
+        std::vector<float> lines(5 * static_cast<size_t>(lineWidth));
+        int lineRows[5] = {-3, -3, -3, -3, -3};
+        auto scaledLine = [&](int row) -> const float * {
+            int slot = (row + 5) % 5;
+            float *line = lines.data() + slot * static_cast<size_t>(lineWidth);
+            if (lineRows[slot] == row) {
+                return line;
+            }
+            lineRows[slot] = row;
+
+            const uint16_t *in = src + static_cast<size_t>(mirrorEdge(row, imageHeight)) * srcStride;
+            int siteRow = (row & 1) << 1;
+            for (int i = 0; i < lineWidth; i++) {
+                int column = mirrorEdge(x - 2 + i, imageWidth);
+                int site = siteRow | (column & 1);
+                line[i] = (in[column] - scale.black[site]) * scale.gain[site];
+            }
+            return line;
+        };
+
+        std::vector<float> acc(3 * static_cast<size_t>(outWidth));
+        for (int oy = firstRow; oy < endRow; oy++) {
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (int j = 0; j < binY; j++) {
+                int row = y + oy * binY + j;
+                // indexed by the window column, so two columns either side are in reach
+                const float *lineAt[5];
+                for (int r = 0; r < 5; r++) {
+                    lineAt[r] = scaledLine(row - 2 + r) + 2;
+                }
+
+                int siteRow = (row & 1) << 1;
+                for (int i = 0; i < usedWidth; i++) {
+                    int site = siteRow | ((x + i) & 1);
+                    int own = pattern[site];
+                    auto at = [&](int dy, int dx) { return lineAt[dy + 2][i + dx]; };
+
+                    // the gradient in each direction, from differences between samples of the same colour,
+                    // and how far each colour sits from the pixel's own colour on that side of it
+                    float gradient[8];
+                    float difference[8][3];
+                    for (int d = 0; d < 8; d++) {
+                        int dy = directions[d][0];
+                        int dx = directions[d][1];
+                        // the two neighbours beside the step: across it for N, E, S and W, along its
+                        // row and column for the diagonals
+                        bool axis = dy == 0 || dx == 0;
+                        int ay = axis ? dx : dy, ax = axis ? dy : 0;
+                        int by = axis ? -dx : 0, bx = axis ? -dy : dx;
+
+                        gradient[d] = std::fabs(at(0, 0) - at(2 * dy, 2 * dx)) + std::fabs(at(-dy, -dx) - at(dy, dx)) +
+                                      0.5f * (std::fabs(at(ay - dy, ax - dx) - at(ay + dy, ax + dx)) +
+                                              std::fabs(at(by - dy, bx - dx) - at(by + dy, bx + dx)));
+
+                        float total[3] = {};
+                        int count[3] = {};
+                        auto add = [&](int sy, int sx) {
+                            int colour = pattern[site ^ ((sy & 1) << 1) ^ (sx & 1)];
+                            total[colour] += at(sy, sx);
+                            count[colour]++;
+                        };
+                        add(0, 0);
+                        add(dy, dx);
+                        add(2 * dy, 2 * dx);
+                        add(ay, ax);
+                        add(by, bx);
+                        if (axis) {
+                            add(dy + ay, dx + ax);
+                            add(dy + by, dx + bx);
+                        }
+                        // every side holds all three colours
+                        for (int c = 0; c < 3; c++) {
+                            difference[d][c] = total[c] / count[c] - total[own] / count[own];
+                        }
+                    }
+
+                    // the directions smoother than the threshold of Chang, Cheung and Pang
+                    float least = *std::min_element(gradient, gradient + 8);
+                    float most  = *std::max_element(gradient, gradient + 8);
+                    float threshold = 1.5f * least + 0.5f * (most - least);
+                    float change[3] = {};
+                    int smooth = 0;
+                    for (int d = 0; d < 8; d++) {
+                        if (gradient[d] <= threshold) {
+                            for (int c = 0; c < 3; c++) {
+                                change[c] += difference[d][c];
+                            }
+                            smooth++;
+                        }
+                    }
+
+                    int ox = i / binX;
+                    for (int c = 0; c < 3; c++) {
+                        acc[c * outWidth + ox] += at(0, 0) + change[c] / smooth;
+                    }
+                }
+            }
+
+            for (int c = 0; c < 3; c++) {
+                const float *in = acc.data() + static_cast<size_t>(c) * outWidth;
+                uint16_t *out = dst + c * planeSize + static_cast<size_t>(oy) * outWidth;
+                for (int ox = 0; ox < outWidth; ox++) {
+                    out[ox] = static_cast<uint16_t>(std::min(std::max(in[ox] / divisor + 0.5f, 0.0f), 65535.0f));
+                }
+            }
+        }
+    }, 16);
+}
+
+#pragma endregion Demosaic
+
+#pragma region Raw decoder output
+
+void quadToPlanar16(const uint16_t (*src)[4], int srcStride, int width, int height, int channels, const uint16_t *curve,
+                    int binX, int binY, bool sum, uint16_t *dst)
+{
+    int outWidth  = width / binX;
+    int outHeight = height / binY;
+    size_t planeSize = static_cast<size_t>(outWidth) * outHeight;
+    uint32_t samples = binX * binY;
+
+    if (binX == 1 && binY == 1) {
+        parallelRows(outHeight, [&](int firstRow, int endRow) {
+            for (int row = firstRow; row < endRow; row++) {
+                const uint16_t (*in)[4] = src + static_cast<size_t>(row) * srcStride;
+                uint16_t *out = dst + static_cast<size_t>(row) * outWidth;
+                for (int x = 0; x < outWidth; x++) {
+                    for (int c = 0; c < channels; c++) {
+                        out[c * planeSize + x] = curve[in[x][c]];
+                    }
+                }
+            }
+        });
+        return;
+    }
+
+    parallelRows(outHeight, [&](int firstRow, int endRow) {
+        // one accumulator row per channel, laid out like the output planes
+        std::vector<uint32_t> acc(static_cast<size_t>(outWidth) * channels);
+        for (int oy = firstRow; oy < endRow; oy++) {
+            std::fill(acc.begin(), acc.end(), 0);
+            for (int j = 0; j < binY; j++) {
+                const uint16_t (*in)[4] = src + (static_cast<size_t>(oy) * binY + j) * srcStride;
+                for (int ox = 0; ox < outWidth; ox++) {
+                    for (int i = 0; i < binX; i++) {
+                        const uint16_t *pixel = in[ox * binX + i];
+                        for (int c = 0; c < channels; c++) {
+                            acc[c * outWidth + ox] += curve[pixel[c]];
+                        }
+                    }
+                }
+            }
+
+            for (int c = 0; c < channels; c++) {
+                uint16_t *out = dst + c * planeSize + static_cast<size_t>(oy) * outWidth;
+                for (int ox = 0; ox < outWidth; ox++) {
+                    out[ox] = combineSamples(acc[c * outWidth + ox], samples, samples, sum);
+                }
+            }
+        }
+    }, 16);
+}
+
+// Finds the white level in a histogram of the top 13 bits of every channel, as dcraw does.
+static int histogramWhite(const std::vector<uint64_t> &histogram, int levels, int channels, size_t clipCount)
+{
+    int white = 0;
+    for (int c = 0; c < channels; c++) {
+        uint64_t total = 0;
+        int level = levels;
+        while (--level > 32) {
+            total += histogram[c * levels + level];
+            if (total > clipCount) {
+                break;
+            }
+        }
+        white = std::max(white, level);
+    }
+
+    return white;
+}
+
+int autoBrightWhite(const uint16_t (*image)[4], int width, int height, int channels, size_t clipCount)
+{
+    const int levels = 0x2000;
+
+    // histogram of the top 13 bits of every channel, built per band and merged
+    std::vector<uint64_t> histogram(static_cast<size_t>(levels) * channels);
+    std::mutex merge;
+    parallelRows(height, [&](int firstRow, int endRow) {
+        std::vector<uint32_t> band(static_cast<size_t>(levels) * channels);
+        const uint16_t (*pixel)[4] = image + static_cast<size_t>(firstRow) * width;
+        const uint16_t (*end)[4] = image + static_cast<size_t>(endRow) * width;
+        for (; pixel < end; pixel++) {
+            for (int c = 0; c < channels; c++) {
+                band[c * levels + ((*pixel)[c] >> 3)]++;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(merge);
+        for (size_t i = 0; i < band.size(); i++) {
+            histogram[i] += band[i];
+        }
+    }, 256);
+
+    return histogramWhite(histogram, levels, channels, clipCount);
+}
+
+int autoBrightWhitePlanes(const uint16_t *planes, size_t planeSize, int channels, size_t clipCount)
+{
+    const int levels = 0x2000;
+
+    std::vector<uint64_t> histogram(static_cast<size_t>(levels) * channels);
+    std::mutex merge;
+    parallelRows(planeSize, [&](int first, int end) {
+        std::vector<uint32_t> band(static_cast<size_t>(levels) * channels);
+        for (int c = 0; c < channels; c++) {
+            const uint16_t *plane = planes + c * planeSize;
+            for (int i = first; i < end; i++) {
+                band[c * levels + (plane[i] >> 3)]++;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(merge);
+        for (size_t i = 0; i < band.size(); i++) {
+            histogram[i] += band[i];
+        }
+    }, 0x10000);
+
+    return histogramWhite(histogram, levels, channels, clipCount);
+}
+
+void developPlanes16(uint16_t *planes, size_t planeSize, const float black[3], const float gain[3], const float matrix[3][3])
+{
+    parallelRows(planeSize, [&](int first, int end) {
+        uint16_t *r = planes;
+        uint16_t *g = planes + planeSize;
+        uint16_t *b = planes + 2 * planeSize;
+        for (int i = first; i < end; i++) {
+            float in[3] = {static_cast<float>(r[i]), static_cast<float>(g[i]), static_cast<float>(b[i])};
+            for (int c = 0; c < 3; c++) {
+                in[c] = std::max(0.0f, in[c] - black[c]) * gain[c];
+            }
+            float out[3];
+            for (int c = 0; c < 3; c++) {
+                out[c] = matrix[c][0] * in[0] + matrix[c][1] * in[1] + matrix[c][2] * in[2];
+            }
+            r[i] = static_cast<uint16_t>(std::min(65535.0f, std::max(0.0f, out[0] + 0.5f)));
+            g[i] = static_cast<uint16_t>(std::min(65535.0f, std::max(0.0f, out[1] + 0.5f)));
+            b[i] = static_cast<uint16_t>(std::min(65535.0f, std::max(0.0f, out[2] + 0.5f)));
+        }
+    }, 0x10000);
+}
+
+void applyCurve16(uint16_t *samples, size_t count, const uint16_t *curve)
+{
+    parallelRows(count, [&](int first, int end) {
+        for (int i = first; i < end; i++) {
+            samples[i] = curve[samples[i]];
+        }
+    }, 0x10000);
+}
+
+void gammaCurve(double power, double toeSlope, int white, uint16_t *curve)
+{
+    // find where the linear toe meets the power segment so the curve stays continuous (as in dcraw)
+    double meet = 0, toeEnd = 0, offset = 0;
+    double bound[2] = {0, 0};
+    bound[toeSlope >= 1] = 1;
+    if (toeSlope && (toeSlope - 1) * (power - 1) <= 0) {
+        for (int i = 0; i < 48; i++) {
+            meet = (bound[0] + bound[1]) / 2;
+            if (power) {
+                bound[(std::pow(meet / toeSlope, -power) - 1) / power - 1 / meet > -1] = meet;
+            } else {
+                bound[meet / std::exp(1 - 1 / meet) < toeSlope] = meet;
+            }
+        }
+        toeEnd = meet / toeSlope;
+        if (power) {
+            offset = meet * (1 / power - 1);
+        }
+    }
+
+    for (int i = 0; i < 0x10000; i++) {
+        double r = static_cast<double>(i) / white;
+        if (r >= 1) {
+            curve[i] = 0xffff;
+            continue;
+        }
+        double value = r < toeEnd ? r * toeSlope
+                     : power      ? std::pow(r, power) * (1 + offset) - offset
+                                  : std::log(r) * meet + 1;
+        curve[i] = static_cast<uint16_t>(0x10000 * value);
+    }
+}
+
+#pragma endregion Raw decoder output
+
+#pragma region Compression
+
+std::vector<std::vector<uint8_t>> gzipTiles(const uint8_t *pixels, int width, int height, int channels, int bpp,
+                                            int tileRows, int level)
+{
+    int bands = (height + tileRows - 1) / tileRows;
+    int sampleBytes = bpp / 8;
+    size_t rowBytes = static_cast<size_t>(width) * sampleBytes;
+    size_t planeBytes = rowBytes * height;
+    std::vector<std::vector<uint8_t>> tiles(static_cast<size_t>(bands) * channels);
+
+    // one stream and one big endian scratch copy serve every tile
+    z_stream stream = {};
+    // 16 added to the window bits asks for a gzip wrapper, which is what GZIP_1 readers expect
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return tiles;
+    }
+    std::vector<uint8_t> scratch;
+
+    for (size_t tile = 0; tile < tiles.size(); tile++) {
+        int firstRow = (tile % bands) * tileRows;
+        int rows = std::min(tileRows, height - firstRow);
+        const uint8_t *in = pixels + (tile / bands) * planeBytes + firstRow * rowBytes;
+        size_t bytes = rows * rowBytes;
+
+        if (sampleBytes == 2) {
+            scratch.resize(bytes);
+            const uint16_t *samples = reinterpret_cast<const uint16_t *>(in);
+            for (size_t i = 0; i < bytes / 2; i++) {
+                uint16_t value = samples[i] ^ 0x8000;
+                scratch[i * 2]     = value >> 8;
+                scratch[i * 2 + 1] = value & 0xff;
+            }
+            in = scratch.data();
+        }
+
+        std::vector<uint8_t> &out = tiles[tile];
+        deflateReset(&stream);
+        out.resize(deflateBound(&stream, bytes));
+        stream.next_in   = const_cast<Bytef *>(in);
+        stream.avail_in  = bytes;
+        stream.next_out  = out.data();
+        stream.avail_out = out.size();
+        // the bound always fits the whole stream, anything short of its end is an error and leaves the tile empty
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            out.clear();
+            continue;
+        }
+        out.resize(stream.total_out);
+    }
+
+    deflateEnd(&stream);
+    return tiles;
+}
+
+void appendFitsCard(std::string &header, const std::string &key, const std::string &value, const std::string &comment)
+{
+    std::string card = key;
+    card.resize(8, ' ');
+    if (!value.empty()) {
+        std::string field = value;
+        if (value[0] == '\'') {
+            field.resize(std::max<size_t>(field.size(), 20), ' ');
+        } else {
+            field.insert(0, std::max<int>(0, 20 - (int)field.size()), ' ');
+        }
+        card += "= " + field;
+        if (!comment.empty()) {
+            card += " / ";
+        }
+    }
+    card += comment;
+    card.resize(80, ' ');
+    header += card;
+}
+
+std::string fitsString(const std::string &text)
+{
+    std::string quoted = "'";
+    for (char c : text) {
+        quoted += c;
+        if (c == '\'') {
+            quoted += c;
+        }
+    }
+    quoted.resize(std::max<size_t>(quoted.size(), 9), ' ');
+    return quoted + "'";
+}
+
+// FITS headers and data units fill whole 2880 byte blocks.
+static size_t fitsBlocks(size_t bytes)
+{
+    return (bytes + 2879) / 2880 * 2880;
+}
+
+std::vector<uint8_t> tiledFits(const std::vector<std::vector<uint8_t>> &tiles, int width, int height, int channels, int bpp,
+                               int tileRows, const std::string &cards)
+{
+    // an empty primary HDU, then the image as a binary table of gzipped tiles
+    std::string header;
+    appendFitsCard(header, "SIMPLE", "T", "file does conform to FITS standard");
+    appendFitsCard(header, "BITPIX", "8");
+    appendFitsCard(header, "NAXIS", "0");
+    appendFitsCard(header, "EXTEND", "T");
+    appendFitsCard(header, "END", "");
+    header.resize(fitsBlocks(header.size()), ' ');
+
+    size_t heapSize = 0;
+    size_t largest = 0;
+    for (const std::vector<uint8_t> &tile : tiles) {
+        heapSize += tile.size();
+        largest = std::max(largest, tile.size());
+    }
+    int naxis = channels == 1 ? 2 : 3;
+    tileRows = std::min(tileRows, height);
+
+    appendFitsCard(header, "XTENSION", fitsString("BINTABLE"), "binary table extension");
+    appendFitsCard(header, "BITPIX", "8");
+    appendFitsCard(header, "NAXIS", "2");
+    appendFitsCard(header, "NAXIS1", "8", "width of table in bytes");
+    appendFitsCard(header, "NAXIS2", std::to_string(tiles.size()), "number of tiles");
+    appendFitsCard(header, "PCOUNT", std::to_string(heapSize), "size of the tile heap");
+    appendFitsCard(header, "GCOUNT", "1");
+    appendFitsCard(header, "TFIELDS", "1");
+    appendFitsCard(header, "TTYPE1", fitsString("COMPRESSED_DATA"));
+    appendFitsCard(header, "TFORM1", fitsString("1PB(" + std::to_string(largest) + ")"));
+    appendFitsCard(header, "ZIMAGE", "T", "extension contains compressed image");
+    appendFitsCard(header, "ZBITPIX", std::to_string(bpp));
+    appendFitsCard(header, "ZNAXIS", std::to_string(naxis));
+    appendFitsCard(header, "ZNAXIS1", std::to_string(width));
+    appendFitsCard(header, "ZNAXIS2", std::to_string(height));
+    if (naxis == 3) {
+        appendFitsCard(header, "ZNAXIS3", std::to_string(channels));
+    }
+    appendFitsCard(header, "ZTILE1", std::to_string(width));
+    appendFitsCard(header, "ZTILE2", std::to_string(tileRows));
+    if (naxis == 3) {
+        appendFitsCard(header, "ZTILE3", "1");
+    }
+    appendFitsCard(header, "ZCMPTYPE", fitsString("GZIP_1"), "compression algorithm");
+    if (bpp == 16) {
+        appendFitsCard(header, "BZERO", "32768", "offset data range to that of unsigned short");
+        appendFitsCard(header, "BSCALE", "1");
+    }
+    header += cards;
+    appendFitsCard(header, "END", "");
+    header.resize(fitsBlocks(header.size()), ' ');
+
+    // the table holds a (size, heap offset) descriptor per tile, big endian, and the tiles follow it in the heap
+    size_t tableSize = tiles.size() * 8;
+    std::vector<uint8_t> file(header.size() + fitsBlocks(tableSize + heapSize));
+    memcpy(file.data(), header.data(), header.size());
+    uint8_t *descriptor = file.data() + header.size();
+    uint8_t *heap = descriptor + tableSize;
+    uint32_t offset = 0;
+    for (const std::vector<uint8_t> &tile : tiles) {
+        uint32_t fields[2] = {static_cast<uint32_t>(tile.size()), offset};
+        for (uint32_t field : fields) {
+            *descriptor++ = field >> 24;
+            *descriptor++ = field >> 16;
+            *descriptor++ = field >> 8;
+            *descriptor++ = field;
+        }
+        memcpy(heap + offset, tile.data(), tile.size());
+        offset += tile.size();
+    }
+
+    return file;
+}
+
+#pragma endregion Compression
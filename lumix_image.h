@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Pixel kernels used when turning decoded camera data into INDI frames.
+// They work on plain buffers so they can run on the processing threads.
+
+// Calls fn(firstRow, endRow) for bands of rows, split across the available cores.
+// Small images are handled on the calling thread.
+void parallelRows(int height, const std::function<void(int, int)> &fn, int minRowsPerBand = 64);
+
+// Converts interleaved pixels (rgbrgb...) into planes (rrr...ggg...bbb...),
+// which is the layout INDI expects for multi-channel frames.
+// srcStride is the distance between source rows in pixels, so a window of a larger image can be converted.
+void deinterleave8(const uint8_t *src, int srcStride, uint8_t *dst, int width, int height, int channels);
+void deinterleave16(const uint16_t *src, int srcStride, uint16_t *dst, int width, int height, int channels);
+
+// Bins an interleaved image by binX x binY and writes it as planes, averaging the samples
+// or summing them (saturating at 16 bits). Leftover rows and columns are dropped.
+void binInterleaved16(const uint16_t *src, int srcStride, int width, int height, int channels, int binX, int binY, bool sum, uint16_t *dst);
+
+// Writes the working image of a raw decoder (four samples per pixel, the first `channels` of them used)
+// as planes, mapping every sample through curve and binning by binX x binY like binInterleaved16.
+// srcStride is the distance between source rows in pixels.
+void quadToPlanar16(const uint16_t (*src)[4], int srcStride, int width, int height, int channels, const uint16_t *curve,
+                    int binX, int binY, bool sum, uint16_t *dst);
+
+// Bins a Bayer mosaic by combining samples of the same colour, so the result is a mosaic
+// with the same CFA pattern. srcStride is the distance between source rows in pixels.
+void binBayer16(const uint16_t *src, int srcStride, int width, int height, int binX, int binY, bool sum, uint16_t *dst);
+
+// Collapses every binX x binY block of a Bayer mosaic (both even) into one RGB pixel by averaging
+// the samples of each colour, written as planes. pattern holds the colour (0 = R, 1 = G, 2 = B)
+// of the 2x2 CFA cell at the image origin, in row order.
+void superpixel16(const uint16_t *src, int srcStride, int width, int height, const int pattern[4], int binX, int binY, uint16_t *dst);
+
+// Black level and gain of each site of the 2x2 CFA cell at the image origin, in row order.
+// A sample becomes (sample - black) * gain, clipped to 16 bits.
+struct CfaScale
+{
+    float black[4];
+    float gain[4];
+};
+
+// Demosaics the width x height window at (x, y) of an imageWidth x imageHeight Bayer mosaic into linear
+// RGB planes with bilinear interpolation, scaling every sample first and binning by binX x binY like
+// binInterleaved16. src points at the image origin, srcStride is the distance between source rows in pixels
+// and pattern is as for superpixel16. The interpolation reads past the window where the image allows.
+void demosaicBilinear16(const uint16_t *src, int srcStride, int imageWidth, int imageHeight, const int pattern[4],
+                        const CfaScale &scale, int x, int y, int width, int height, int binX, int binY, bool sum,
+                        uint16_t *dst);
+
+// Demosaics like demosaicBilinear16 with variable number of gradients interpolation: each missing colour
+// is the pixel's own sample plus the colour differences averaged over the smoothest of eight directions
+// in its 5x5 neighbourhood, so edges get less colour fringing at about eight times the cost.
+void demosaicVNG16(const uint16_t *src, int srcStride, int imageWidth, int imageHeight, const int pattern[4],
+                   const CfaScale &scale, int x, int y, int width, int height, int binX, int binY, bool sum,
+                   uint16_t *dst);
+
+// Finds the white level dcraw uses to auto brighten an image, in 13 bit units: the highest level
+// of any channel that more than clipCount pixels reach or exceed.
+int autoBrightWhite(const uint16_t (*image)[4], int width, int height, int channels, size_t clipCount);
+
+// Same as autoBrightWhite, for an image stored as planes of planeSize samples.
+int autoBrightWhitePlanes(const uint16_t *planes, size_t planeSize, int channels, size_t clipCount);
+
+// Develops RGB planes of raw camera samples the way dcraw does before its output curve: the black level of every
+// colour is taken off and the rest scaled by its gain, then the colours are mixed through matrix (a row per
+// output colour), clipping to 16 bits.
+void developPlanes16(uint16_t *planes, size_t planeSize, const float black[3], const float gain[3], const float matrix[3][3]);
+
+// Maps every sample through the 0x10000 entry curve.
+void applyCurve16(uint16_t *samples, size_t count, const uint16_t *curve);
+
+// Fills the 0x10000 entry output curve with a BT.709 style gamma (power, toe slope) that maps white to full scale.
+void gammaCurve(double power, double toeSlope, int white, uint16_t *curve);
+
+// Cuts the planes of a width x height x channels image into tiles of tileRows rows and gzips every tile on its
+// own, the way the GZIP_1 algorithm of the FITS tiled image convention stores them: 16 bit samples go big endian
+// with 32768 taken off, so they read back as signed integers with BZERO = 32768. The tiles are compressed one
+// after the other on the calling thread, as frames are already compressed in parallel on the processing threads.
+// The tiles are returned in FITS order, the bands of the first plane first. A tile that fails to compress is empty.
+std::vector<std::vector<uint8_t>> gzipTiles(const uint8_t *pixels, int width, int height, int channels, int bpp,
+                                            int tileRows, int level);
+
+// Appends an 80 character FITS header card. Numbers and logicals are given right aligned, strings already quoted.
+void appendFitsCard(std::string &header, const std::string &key, const std::string &value, const std::string &comment = "");
+
+// Quotes a FITS string value, padded to the 8 characters readers expect at least.
+std::string fitsString(const std::string &text);
+
+// Writes the tiles of gzipTiles as a .fits.fz file: an empty primary HDU and a compressed image extension.
+// cards are extra header cards for the image (whole 80 character cards, without END).
+std::vector<uint8_t> tiledFits(const std::vector<std::vector<uint8_t>> &tiles, int width, int height, int channels, int bpp,
+                               int tileRows, const std::string &cards);
@@ -0,0 +1,64 @@
+#include "lumix_image.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Checks deinterleave8/16 bit for bit against the scalar loop they replaced, on odd widths,
+// windows of wider images and 1, 3 and 4 channels.
+
+template <typename T>
+static std::vector<T> referenceDeinterleave(const std::vector<T> &src, int srcStride, int width, int height, int channels)
+{
+    size_t planeSize = static_cast<size_t>(width) * height;
+    std::vector<T> dst(planeSize * channels);
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+            for (int c = 0; c < channels; c++) {
+                dst[c * planeSize + static_cast<size_t>(row) * width + col] =
+                    src[(static_cast<size_t>(row) * srcStride + col) * channels + c];
+            }
+        }
+    }
+    return dst;
+}
+
+template <typename T>
+static bool check(void (*deinterleave)(const T *, int, T *, int, int, int), int width, int height, int stride, int channels)
+{
+    std::vector<T> src(static_cast<size_t>(stride) * height * channels);
+    for (size_t i = 0; i < src.size(); i++) {
+        src[i] = static_cast<T>(i * 2654435761u >> 7);
+    }
+
+    std::vector<T> expected = referenceDeinterleave(src, stride, width, height, channels);
+    std::vector<T> actual(expected.size());
+    deinterleave(src.data(), stride, actual.data(), width, height, channels);
+
+    if (actual != expected) {
+        fprintf(stderr, "deinterleave%zu failed: %ix%i, stride %i, %i channels\n", sizeof(T) * 8, width, height, stride, channels);
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    const int widths[] = {1, 7, 15, 16, 17, 31, 33, 257, 1001};
+    const int heights[] = {1, 3, 130};
+    const int channelCounts[] = {1, 3, 4};
+
+    bool ok = true;
+    for (int width : widths) {
+        for (int height : heights) {
+            for (int channels : channelCounts) {
+                for (int extra : {0, 1, 5}) {
+                    ok = check<uint8_t>(deinterleave8, width, height, width + extra, channels) && ok;
+                    ok = check<uint16_t>(deinterleave16, width, height, width + extra, channels) && ok;
+                }
+            }
+        }
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
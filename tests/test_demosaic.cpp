@@ -0,0 +1,116 @@
+#include "lumix_image.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Demosaics mosaics of one flat colour with both kernels, which have to give that colour back
+// everywhere, binned or not, and grey mosaics with a sharp edge, where VNG has to fringe less than
+// bilinear interpolation.
+
+typedef void (*Demosaic)(const uint16_t *, int, int, int, const int[4], const CfaScale &, int, int, int, int, int, int,
+                         bool, uint16_t *);
+
+// fills an imageWidth x imageHeight mosaic (padded to stride) with a colour of the scaled samples,
+// undoing the scale so every site reads back as that colour
+static std::vector<uint16_t> flatMosaic(int imageWidth, int imageHeight, int stride, const int pattern[4],
+                                        const CfaScale &scale, const float colour[3])
+{
+    std::vector<uint16_t> mosaic(static_cast<size_t>(stride) * imageHeight, 0);
+    for (int row = 0; row < imageHeight; row++) {
+        for (int column = 0; column < imageWidth; column++) {
+            int site = ((row & 1) << 1) | (column & 1);
+            mosaic[static_cast<size_t>(row) * stride + column] =
+                static_cast<uint16_t>(colour[pattern[site]] / scale.gain[site] + scale.black[site]);
+        }
+    }
+    return mosaic;
+}
+
+static bool checkFlat(Demosaic demosaic, const char *name, const int pattern[4], int x, int y, int width, int height,
+                      int binX, int binY, bool sum)
+{
+    const int imageWidth = 64, imageHeight = 48, stride = 70;
+    // gains that are powers of two keep the round trip through the mosaic exact
+    const CfaScale scale = {{100, 120, 110, 90}, {2.0f, 1.0f, 1.0f, 4.0f}};
+    const float colour[3] = {3000, 9000, 2000};
+    std::vector<uint16_t> mosaic = flatMosaic(imageWidth, imageHeight, stride, pattern, scale, colour);
+
+    int outWidth = width / binX, outHeight = height / binY;
+    size_t planeSize = static_cast<size_t>(outWidth) * outHeight;
+    std::vector<uint16_t> planes(planeSize * 3, 0);
+    demosaic(mosaic.data(), stride, imageWidth, imageHeight, pattern, scale, x, y, width, height, binX, binY, sum,
+             planes.data());
+
+    for (int c = 0; c < 3; c++) {
+        float expected = colour[c] * (sum ? binX * binY : 1);
+        expected = expected > 65535 ? 65535 : expected;
+        for (size_t i = 0; i < planeSize; i++) {
+            if (std::abs(planes[c * planeSize + i] - expected) > 1) {
+                fprintf(stderr, "%s failed on a flat field at %zu, colour %i: %u instead of %.0f "
+                        "(%ix%i at %i,%i, bin %ix%i%s)\n", name, i, c, planes[c * planeSize + i], expected,
+                        width, height, x, y, binX, binY, sum ? " summed" : "");
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// the largest difference between the colours of any pixel, for a grey mosaic with a vertical edge
+static int edgeFringe(Demosaic demosaic, const int pattern[4])
+{
+    const int width = 32, height = 16;
+    const CfaScale scale = {{0, 0, 0, 0}, {1.0f, 1.0f, 1.0f, 1.0f}};
+    std::vector<uint16_t> mosaic(static_cast<size_t>(width) * height);
+    for (int row = 0; row < height; row++) {
+        for (int column = 0; column < width; column++) {
+            mosaic[static_cast<size_t>(row) * width + column] = column < 15 ? 1000 : 20000;
+        }
+    }
+
+    size_t planeSize = static_cast<size_t>(width) * height;
+    std::vector<uint16_t> planes(planeSize * 3);
+    demosaic(mosaic.data(), width, width, height, pattern, scale, 0, 0, width, height, 1, 1, false, planes.data());
+
+    int fringe = 0;
+    for (size_t i = 0; i < planeSize; i++) {
+        for (int c = 1; c < 3; c++) {
+            fringe = std::max(fringe, std::abs(planes[c * planeSize + i] - planes[i]));
+        }
+    }
+    return fringe;
+}
+
+int main()
+{
+    const int patterns[4][4] = {{0, 1, 1, 2}, {2, 1, 1, 0}, {1, 0, 2, 1}, {1, 2, 0, 1}};
+    const Demosaic kernels[2] = {demosaicBilinear16, demosaicVNG16};
+    const char *names[2] = {"demosaicBilinear16", "demosaicVNG16"};
+
+    bool ok = true;
+    for (const int *pattern : patterns) {
+        for (int k = 0; k < 2; k++) {
+            // whole images, windows against each edge and one inside, with odd origins
+            ok &= checkFlat(kernels[k], names[k], pattern, 0, 0, 64, 48, 1, 1, false);
+            ok &= checkFlat(kernels[k], names[k], pattern, 1, 3, 63, 45, 1, 1, false);
+            ok &= checkFlat(kernels[k], names[k], pattern, 5, 7, 20, 30, 2, 2, false);
+            ok &= checkFlat(kernels[k], names[k], pattern, 0, 1, 64, 47, 3, 2, true);
+            ok &= checkFlat(kernels[k], names[k], pattern, 2, 0, 61, 48, 4, 4, false);
+        }
+
+        int bilinear = edgeFringe(demosaicBilinear16, pattern);
+        int vng = edgeFringe(demosaicVNG16, pattern);
+        if (vng >= bilinear) {
+            fprintf(stderr, "demosaicVNG16 fringes an edge by %i, bilinear interpolation by %i\n", vng, bilinear);
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        return EXIT_FAILURE;
+    }
+    printf("demosaic kernels passed\n");
+    return EXIT_SUCCESS;
+}
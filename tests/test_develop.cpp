@@ -0,0 +1,104 @@
+#include "lumix_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Checks the kernels that develop half size frames: developPlanes16 against a direct evaluation, and
+// autoBrightWhitePlanes against autoBrightWhite on the same pixels stored interleaved.
+
+static bool checkDevelop(size_t planeSize)
+{
+    std::vector<uint16_t> planes(planeSize * 3);
+    for (size_t i = 0; i < planes.size(); i++) {
+        planes[i] = static_cast<uint16_t>(i * 2654435761u >> 16);
+    }
+    std::vector<uint16_t> raw = planes;
+
+    const float black[3] = {512, 600, 480};
+    const float gain[3] = {2.1f, 1.0f, 1.6f};
+    const float matrix[3][3] = {{1.6f, -0.5f, -0.1f}, {-0.2f, 1.4f, -0.2f}, {0.0f, -0.6f, 1.6f}};
+    developPlanes16(planes.data(), planeSize, black, gain, matrix);
+
+    for (size_t i = 0; i < planeSize; i++) {
+        float in[3];
+        for (int c = 0; c < 3; c++) {
+            in[c] = std::max(0.0f, raw[c * planeSize + i] - black[c]) * gain[c];
+        }
+        for (int c = 0; c < 3; c++) {
+            float out = matrix[c][0] * in[0] + matrix[c][1] * in[1] + matrix[c][2] * in[2];
+            int expected = static_cast<int>(std::min(65535.0f, std::max(0.0f, out + 0.5f)));
+            if (std::abs(planes[c * planeSize + i] - expected) > 1) {
+                fprintf(stderr, "developPlanes16 failed at %zu, colour %i: %u instead of %i\n", i, c,
+                        planes[c * planeSize + i], expected);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool checkWhite(int width, int height, int channels)
+{
+    size_t planeSize = static_cast<size_t>(width) * height;
+    std::vector<uint16_t> planes(planeSize * channels);
+    std::vector<uint16_t> quads(planeSize * 4);
+    for (size_t i = 0; i < planeSize; i++) {
+        for (int c = 0; c < channels; c++) {
+            // mostly dark with a few bright pixels, so the clip count matters
+            uint16_t value = static_cast<uint16_t>((i * (c + 3) * 2654435761u >> 20) % (i % 97 == 0 ? 65536 : 9000));
+            planes[c * planeSize + i] = value;
+            quads[i * 4 + c] = value;
+        }
+    }
+
+    size_t clipCount = planeSize / 100;
+    int expected = autoBrightWhite(reinterpret_cast<const uint16_t (*)[4]>(quads.data()), width, height, channels, clipCount);
+    int actual = autoBrightWhitePlanes(planes.data(), planeSize, channels, clipCount);
+    if (actual != expected) {
+        fprintf(stderr, "autoBrightWhitePlanes failed: %ix%ix%i gives %i instead of %i\n", width, height, channels, actual, expected);
+        return false;
+    }
+    return true;
+}
+
+static bool checkCurve(size_t count)
+{
+    std::vector<uint16_t> curve(0x10000);
+    for (size_t i = 0; i < curve.size(); i++) {
+        curve[i] = static_cast<uint16_t>(65535 - i);
+    }
+    std::vector<uint16_t> samples(count);
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = static_cast<uint16_t>(i * 7);
+    }
+    applyCurve16(samples.data(), count, curve.data());
+    for (size_t i = 0; i < count; i++) {
+        if (samples[i] != static_cast<uint16_t>(65535 - static_cast<uint16_t>(i * 7))) {
+            fprintf(stderr, "applyCurve16 failed at %zu\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    bool ok = true;
+    for (size_t planeSize : {1, 17, 4096, 300001}) {
+        ok &= checkDevelop(planeSize);
+        ok &= checkCurve(planeSize * 3);
+    }
+    for (int channels : {1, 3}) {
+        ok &= checkWhite(37, 11, channels);
+        ok &= checkWhite(1003, 517, channels);
+    }
+
+    if (!ok) {
+        return EXIT_FAILURE;
+    }
+    printf("develop kernels passed\n");
+    return EXIT_SUCCESS;
+}
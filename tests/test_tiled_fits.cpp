@@ -0,0 +1,254 @@
+#include "lumix_image.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#ifdef LUMIX_TEST_CFITSIO
+#include <fitsio.h>
+#endif
+
+// Writes frames with gzipTiles and tiledFits and reads them back with a reader written from the FITS
+// tiled image convention alone (and with cfitsio when it is available), comparing every sample.
+
+typedef std::map<std::string, std::string> Header;
+
+// Reads the header starting at offset, moving offset past it. Quotes and padding are taken off the values.
+static bool readHeader(const std::vector<uint8_t> &file, size_t &offset, Header &header)
+{
+    for (;;) {
+        if (offset + 80 > file.size()) {
+            fprintf(stderr, "header runs past the end of the file\n");
+            return false;
+        }
+        std::string card(reinterpret_cast<const char *>(file.data()) + offset, 80);
+        offset += 80;
+
+        std::string key = card.substr(0, 8);
+        key.erase(key.find_last_not_of(' ') + 1);
+        if (key == "END") {
+            break;
+        }
+        if (card.compare(8, 2, "= ") != 0) {
+            continue;
+        }
+
+        std::string value = card.substr(10);
+        size_t first = value.find_first_not_of(' ');
+        if (first != std::string::npos && value[first] == '\'') {
+            size_t last = value.find('\'', first + 1);
+            value = value.substr(first + 1, last - first - 1);
+        } else {
+            value = value.substr(0, value.find('/'));
+        }
+        value.erase(0, value.find_first_not_of(' '));
+        value.erase(value.find_last_not_of(' ') + 1);
+        header[key] = value;
+    }
+
+    if (offset % 2880 != 0) {
+        offset += 2880 - offset % 2880;
+    }
+    return true;
+}
+
+static long number(const Header &header, const std::string &key)
+{
+    auto found = header.find(key);
+    return found == header.end() ? -1 : atol(found->second.c_str());
+}
+
+static uint32_t bigEndian32(const uint8_t *bytes)
+{
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+}
+
+// Decodes the compressed image extension back into planes of unsigned samples.
+static bool readTiledFits(const std::vector<uint8_t> &file, int bpp, std::vector<uint8_t> &planes)
+{
+    if (file.size() % 2880 != 0) {
+        fprintf(stderr, "file size %zu is not a whole number of blocks\n", file.size());
+        return false;
+    }
+
+    size_t offset = 0;
+    Header primary, table;
+    if (!readHeader(file, offset, primary) || !readHeader(file, offset, table)) {
+        return false;
+    }
+    if (primary["SIMPLE"] != "T" || number(primary, "NAXIS") != 0 || primary["EXTEND"] != "T") {
+        fprintf(stderr, "bad primary header\n");
+        return false;
+    }
+    if (table["XTENSION"] != "BINTABLE" || table["ZIMAGE"] != "T" || table["ZCMPTYPE"] != "GZIP_1" ||
+        table["TTYPE1"] != "COMPRESSED_DATA" || table["TFORM1"].compare(0, 4, "1PB(") != 0 ||
+        number(table, "NAXIS1") != 8 || number(table, "TFIELDS") != 1 || number(table, "ZBITPIX") != bpp) {
+        fprintf(stderr, "bad compressed image header\n");
+        return false;
+    }
+
+    long naxis = number(table, "ZNAXIS");
+    long width = number(table, "ZNAXIS1");
+    long height = number(table, "ZNAXIS2");
+    long channels = naxis == 3 ? number(table, "ZNAXIS3") : 1;
+    long tileWidth = number(table, "ZTILE1");
+    long tileRows = number(table, "ZTILE2");
+    long rows = number(table, "NAXIS2");
+    long heapSize = number(table, "PCOUNT");
+    if (tileWidth != width || tileRows <= 0 || (naxis == 3 && number(table, "ZTILE3") != 1)) {
+        fprintf(stderr, "unexpected tiling\n");
+        return false;
+    }
+    long bands = (height + tileRows - 1) / tileRows;
+    if (rows != bands * channels || offset + 8 * rows + heapSize > file.size()) {
+        fprintf(stderr, "table of %li tiles doesn't match the image\n", rows);
+        return false;
+    }
+    if (bpp == 16 && (number(table, "BZERO") != 32768 || number(table, "BSCALE") != 1)) {
+        fprintf(stderr, "16 bit samples need BZERO = 32768\n");
+        return false;
+    }
+
+    const uint8_t *descriptors = file.data() + offset;
+    const uint8_t *heap = descriptors + 8 * rows;
+    size_t sampleBytes = bpp / 8;
+    size_t planeSize = static_cast<size_t>(width) * height;
+    planes.assign(planeSize * channels * sampleBytes, 0);
+    std::vector<uint8_t> tile;
+
+    for (long row = 0; row < rows; row++) {
+        uint32_t size = bigEndian32(descriptors + row * 8);
+        uint32_t start = bigEndian32(descriptors + row * 8 + 4);
+        if (start + size > static_cast<uint64_t>(heapSize)) {
+            fprintf(stderr, "tile %li runs past the heap\n", row);
+            return false;
+        }
+
+        long plane = row / bands;
+        long firstRow = (row % bands) * tileRows;
+        long tileHeight = std::min(tileRows, height - firstRow);
+        tile.assign(tileHeight * width * sampleBytes + 1, 0);
+
+        z_stream stream = {};
+        inflateInit2(&stream, 15 + 32);
+        stream.next_in = const_cast<Bytef *>(heap + start);
+        stream.avail_in = size;
+        stream.next_out = tile.data();
+        stream.avail_out = tile.size();
+        int ret = inflate(&stream, Z_FINISH);
+        size_t unpacked = stream.total_out;
+        inflateEnd(&stream);
+        if (ret != Z_STREAM_END || unpacked != tile.size() - 1) {
+            fprintf(stderr, "tile %li inflated to %zu bytes instead of %zu\n", row, unpacked, tile.size() - 1);
+            return false;
+        }
+
+        // big endian signed samples, BZERO brings them back to unsigned
+        size_t first = plane * planeSize + firstRow * width;
+        for (size_t i = 0; i < static_cast<size_t>(tileHeight * width); i++) {
+            if (sampleBytes == 2) {
+                uint16_t value = static_cast<uint16_t>((tile[i * 2] << 8) | tile[i * 2 + 1]);
+                int16_t stored;
+                memcpy(&stored, &value, 2);
+                uint16_t sample = static_cast<uint16_t>(stored + 32768);
+                memcpy(&planes[(first + i) * 2], &sample, 2);
+            } else {
+                planes[first + i] = tile[i];
+            }
+        }
+    }
+
+    return true;
+}
+
+#ifdef LUMIX_TEST_CFITSIO
+static bool readWithCfitsio(std::vector<uint8_t> file, int bpp, std::vector<uint8_t> &planes)
+{
+    fitsfile *fits = nullptr;
+    int status = 0;
+    void *memory = file.data();
+    size_t memorySize = file.size();
+    fits_open_memfile(&fits, "frame.fits.fz", READONLY, &memory, &memorySize, 0, nullptr, &status);
+    int type = 0;
+    fits_movabs_hdu(fits, 2, &type, &status);
+
+    int naxis = 0;
+    long naxes[3] = {1, 1, 1};
+    fits_get_img_dim(fits, &naxis, &status);
+    fits_get_img_size(fits, 3, naxes, &status);
+    long samples = naxes[0] * naxes[1] * naxes[2];
+    planes.assign(samples * (bpp / 8), 0);
+    int anyNull = 0;
+    fits_read_img(fits, bpp == 16 ? TUSHORT : TBYTE, 1, samples, nullptr, planes.data(), &anyNull, &status);
+    fits_close_file(fits, &status);
+
+    if (status != 0) {
+        char message[FLEN_STATUS];
+        fits_get_errstatus(status, message);
+        fprintf(stderr, "cfitsio failed to read the frame: %s\n", message);
+        return false;
+    }
+    return true;
+}
+#endif
+
+static bool check(int width, int height, int channels, int bpp, int tileRows)
+{
+    size_t sampleBytes = bpp / 8;
+    size_t samples = static_cast<size_t>(width) * height * channels;
+    std::vector<uint8_t> pixels(samples * sampleBytes);
+    for (size_t i = 0; i < samples; i++) {
+        // a gradient with noise on it, and the extremes of the range
+        uint32_t value = (i % 5 == 0) ? 0 : (i % 7 == 0) ? 0xffff : static_cast<uint32_t>(i * 13 + (i * 2654435761u >> 25));
+        if (sampleBytes == 2) {
+            uint16_t sample = static_cast<uint16_t>(value);
+            memcpy(&pixels[i * 2], &sample, 2);
+        } else {
+            pixels[i] = static_cast<uint8_t>(value);
+        }
+    }
+
+    std::vector<std::vector<uint8_t>> tiles = gzipTiles(pixels.data(), width, height, channels, bpp, tileRows, 1);
+    std::string cards;
+    appendFitsCard(cards, "INSTRUME", fitsString("Lumix"), "test frame");
+    std::vector<uint8_t> file = tiledFits(tiles, width, height, channels, bpp, tileRows, cards);
+
+    std::vector<uint8_t> decoded;
+    if (!readTiledFits(file, bpp, decoded) || decoded != pixels) {
+        fprintf(stderr, "round trip failed: %ix%ix%i, %i bit, %i row tiles\n", width, height, channels, bpp, tileRows);
+        return false;
+    }
+#ifdef LUMIX_TEST_CFITSIO
+    if (!readWithCfitsio(file, bpp, decoded) || decoded != pixels) {
+        fprintf(stderr, "cfitsio round trip failed: %ix%ix%i, %i bit, %i row tiles\n", width, height, channels, bpp, tileRows);
+        return false;
+    }
+#endif
+    return true;
+}
+
+int main()
+{
+    bool ok = true;
+    for (int bpp : {8, 16}) {
+        for (int channels : {1, 3}) {
+            for (int height : {1, 16, 100}) {
+                for (int tileRows : {1, 16, 200}) {
+                    ok &= check(37, height, channels, bpp, tileRows);
+                }
+            }
+        }
+    }
+    ok &= check(6000, 40, 3, 16, 16);
+
+    if (!ok) {
+        return EXIT_FAILURE;
+    }
+    printf("tiled FITS round trips passed\n");
+    return EXIT_SUCCESS;
+}